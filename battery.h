@@ -68,15 +68,13 @@ BATTERY_init()
    // for 16 MHz system clock:
    //    prescaler  adc clock
    //       128      125  KHz
-
-   #if CLOCK_MHZ != 8 && CLOCK_MHZ != 16
-   #error CLOCK_MHZ
-   #endif
+   //
+   // for 20 MHz system clock:
+   //    prescaler  adc clock
+   //       128      156  KHz
    
    ADCSRA = 0
-          | (1 << ADPS0)  // adc prescaler = divide by 128 (highest available divisor, greatest accuracy)
-          | (1 << ADPS1)
-          | (1 << ADPS2)
+          | CLOCK_ADPS    // adc prescaler, from clock plan ("clock.h"): highest divisor in range, for greatest accuracy
           
           | (1 << ADEN)   // enable adc
           ;
@@ -120,12 +118,16 @@ BATTERY_read()
 // 3.70v = 11%     7.40v = 11%     11.10v = 11%    14.80v = 11%
 // 3.6?v = 00%     7.2?v = 00%     10.8?v = 00%    14.4?v = 00%
 
+#define BATTERY_LOW      7.60 // "warning"   threshold, volts (40% capacity)
+#define BATTERY_CRITICAL 7.45 // "power off" threshold, volts (15% capacity)
+
+#if 0 // UNUSED
 // Is battery voltage lower than "warning" threshold?
 //
 PUBLIC BOOL
 BATTERY_low()
    {
-   return BATTERY_read() <= 7.60; // 40% capacity
+   return BATTERY_read() <= BATTERY_LOW;
    }
 
 // Is battery voltage lower than "power off" threshold?
@@ -133,5 +135,6 @@ BATTERY_low()
 PUBLIC BOOL
 BATTERY_critical()
    {
-   return BATTERY_read() <= 7.45; // 15% capacity
+   return BATTERY_read() <= BATTERY_CRITICAL;
    }
+#endif
@@ -0,0 +1,125 @@
+// Clock plan: divisors for all timers and peripherals, derived at compile time from the system clock rate and the rates we want.
+//
+// Taken:    CLOCK_MHZ  system clock rate
+//           TWI_KHZ    twi clock rate                 (up to 400)
+//           USART_BAUD serial port baud rate
+//           TICKER_HZ  timer tick interrupt rate      [TIMER0] (optional: derived from CLOCK_MHZ if not given)
+//           SERVO_HZ   servo pwm frame rate           [TIMER1]
+// Yields:   TICKER_HZ, CLOCK_TWBR, CLOCK_TWBR_KHZ(), CLOCK_UBRR, CLOCK_TICKER_CS, CLOCK_TICKER_TOP, CLOCK_SERVO_TOP, CLOCK_SERVO_COUNTS_PER_MS, CLOCK_ADPS, CLOCK_SPI_SLOW_SPR
+//
+// Rates that cannot be generated exactly (or, for the usart, to within 2%) are rejected at compile time.
+//
+
+#define CLOCK_HZ (CLOCK_MHZ * 1000000L)
+
+// --------------------------------------------------------------------
+// TWI.
+//
+//    SCL frequency = CLOCK_HZ / (16 + 2 * TWBR * prescaler), with prescaler = 1
+//
+// We round TWBR up, so the bus never runs faster than asked.
+// (CLOCK_TWBR_KHZ is also used at run time, by TWI_probe.)
+//
+#define CLOCK_TWBR_KHZ(KHZ) ((((CLOCK_HZ + (KHZ) * 1000L - 1) / ((KHZ) * 1000L)) - 16 + 1) / 2)
+#define CLOCK_TWBR          CLOCK_TWBR_KHZ(TWI_KHZ)
+
+#if TWI_KHZ > 400
+#error TWI_KHZ exceeds twi fast mode limit
+#endif
+
+#if CLOCK_TWBR < 0 || CLOCK_TWBR > 255
+#error TWI_KHZ cannot be generated at this CLOCK_MHZ
+#endif
+
+// --------------------------------------------------------------------
+// USART (asynchronous normal mode, U2X0 = 0).
+//
+//    baud rate = CLOCK_HZ / (16 * (UBRR + 1))
+//
+#define CLOCK_UBRR ((CLOCK_HZ + 8L * USART_BAUD) / (16L * USART_BAUD) - 1)
+#define CLOCK_BAUD (CLOCK_HZ / (16L * (CLOCK_UBRR + 1)))
+
+#if CLOCK_BAUD * 50 > USART_BAUD * 51L || CLOCK_BAUD * 50 < USART_BAUD * 49L
+#error USART_BAUD cannot be generated to within 2% at this CLOCK_MHZ
+#endif
+
+// --------------------------------------------------------------------
+// TIMER0 (ticker), clear on terminal count.
+//
+//    interrupt rate = CLOCK_HZ / PRESCALER / (TOP + 1), TOP <= 255
+//
+// Unless a rate is asked for, the tick follows the clock: 250 counts at prescaler 64, which is 500 Hz at 8 MHz, 1000 Hz at 16 MHz,
+// and 1250 Hz at 20 MHz (ticker.h then checks that it divides down to IMU_HZ).
+// Otherwise we use the smallest prescaler that yields the rate exactly.
+//
+#ifndef TICKER_HZ
+#if CLOCK_HZ % (64L * 250)
+#error timer tick rate cannot be derived exactly at this CLOCK_MHZ (define TICKER_HZ)
+#endif
+#define TICKER_HZ (CLOCK_HZ / (64L * 250))
+#endif
+
+#if   CLOCK_HZ % (8L * TICKER_HZ) == 0 && CLOCK_HZ / (8L * TICKER_HZ) <= 256
+#define CLOCK_TICKER_PRESCALER 8
+#define CLOCK_TICKER_CS        ((0 << CS02) | (1 << CS01) | (0 << CS00))
+#elif CLOCK_HZ % (64L * TICKER_HZ) == 0 && CLOCK_HZ / (64L * TICKER_HZ) <= 256
+#define CLOCK_TICKER_PRESCALER 64
+#define CLOCK_TICKER_CS        ((0 << CS02) | (1 << CS01) | (1 << CS00))
+#elif CLOCK_HZ % (256L * TICKER_HZ) == 0 && CLOCK_HZ / (256L * TICKER_HZ) <= 256
+#define CLOCK_TICKER_PRESCALER 256
+#define CLOCK_TICKER_CS        ((1 << CS02) | (0 << CS01) | (0 << CS00))
+#elif CLOCK_HZ % (1024L * TICKER_HZ) == 0 && CLOCK_HZ / (1024L * TICKER_HZ) <= 256
+#define CLOCK_TICKER_PRESCALER 1024
+#define CLOCK_TICKER_CS        ((1 << CS02) | (0 << CS01) | (1 << CS00))
+#else
+#error TICKER_HZ cannot be generated exactly at this CLOCK_MHZ
+#endif
+
+#define CLOCK_TICKER_TOP (CLOCK_HZ / CLOCK_TICKER_PRESCALER / TICKER_HZ - 1)
+
+// --------------------------------------------------------------------
+// TIMER1 (servo), phase and frequency correct pwm, prescaler = 8.
+//
+//    frame rate  = CLOCK_HZ / 8 / (2 * TOP)
+//    pulse width = 2 * OCR1A timer counts
+//
+#define CLOCK_SERVO_TOP           (CLOCK_HZ / 8 / 2 / SERVO_HZ)
+#define CLOCK_SERVO_COUNTS_PER_MS (CLOCK_HZ / 8 / 2 / 1000)
+
+#if CLOCK_HZ % (8L * 2 * SERVO_HZ) || CLOCK_SERVO_TOP > 65535
+#error SERVO_HZ cannot be generated exactly at this CLOCK_MHZ
+#endif
+
+#if CLOCK_HZ % (8L * 2 * 10000)
+#error servo pulse widths cannot be generated to 10us resolution at this CLOCK_MHZ
+#endif
+
+// --------------------------------------------------------------------
+// SPI.
+//
+// The fast clock is system clock / 4 (at most 5 MHz, within sensor limits).
+// The slow clock, for sensor configuration, must not exceed 1 MHz.
+//
+#if   CLOCK_HZ / 16 <= 1000000
+#define CLOCK_SPI_SLOW_SPR ((0 << SPR1) | (1 << SPR0)) // divide by 16
+#else
+#define CLOCK_SPI_SLOW_SPR ((1 << SPR1) | (0 << SPR0)) // divide by 64
+#endif
+
+// --------------------------------------------------------------------
+// ADC.
+//
+// The adc needs a 50-200 KHz clock (lower = more accurate, higher = faster conversion).
+// We use the highest divisor that keeps it at or above 50 KHz.
+//
+#if   CLOCK_HZ / 128 >= 50000 && CLOCK_HZ / 128 <= 200000
+#define CLOCK_ADPS ((1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0)) // divide by 128
+#elif CLOCK_HZ /  64 >= 50000 && CLOCK_HZ /  64 <= 200000
+#define CLOCK_ADPS ((1 << ADPS2) | (1 << ADPS1) | (0 << ADPS0)) // divide by 64
+#elif CLOCK_HZ /  32 >= 50000 && CLOCK_HZ /  32 <= 200000
+#define CLOCK_ADPS ((1 << ADPS2) | (0 << ADPS1) | (1 << ADPS0)) // divide by 32
+#elif CLOCK_HZ /  16 >= 50000 && CLOCK_HZ /  16 <= 200000
+#define CLOCK_ADPS ((1 << ADPS2) | (0 << ADPS1) | (0 << ADPS0)) // divide by 16
+#else
+#error adc clock cannot be generated at this CLOCK_MHZ
+#endif
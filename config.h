@@ -8,11 +8,23 @@ struct
    BYTE  state;            // CONFIG_READY indicates normal startup, otherwise debug startup
    FLOAT bat_k;            // battery voltage scale factor
    FLOAT center;           // servo centering adjustment
-   SWORD ax, ay, az;       // accelerometer biases
-   SWORD gx, gy, gz;       // gyro biases
+   SWORD ax[MPU_SENSORS],  // accelerometer biases, per sensor
+         ay[MPU_SENSORS],
+         az[MPU_SENSORS];
+   SWORD gx[MPU_SENSORS],  // gyro biases, per sensor
+         gy[MPU_SENSORS],
+         gz[MPU_SENSORS];
    FLOAT roll, pitch, yaw; // camera orientation with respect to bike
    FLOAT lgain, rgain;     // servo travel volume
    BOOL  reverse;          // servo polarity with respect to camera lens and imu
+#if HAVE_MAGNETOMETER
+   SWORD mx, my, mz;       // magnetometer biases
+#endif
+#if HAVE_TEMPCO
+   SDWORD gtx[MPU_SENSORS][GYRO_TEMP_POINTS], // gyro bias model, per sensor
+          gty[MPU_SENSORS][GYRO_TEMP_POINTS],
+          gtz[MPU_SENSORS][GYRO_TEMP_POINTS];
+#endif
    } CONFIG_Data;
 
 void
@@ -23,13 +35,25 @@ CONFIG_init()
    BATTERY_k     = CONFIG_Data.bat_k   = BATTERY_K_DEFAULT;
    SERVO_center  = CONFIG_Data.center  = 0;
 
-   ACCO_x_bias   = CONFIG_Data.ax      = 0;
-   ACCO_y_bias   = CONFIG_Data.ay      = 0;
-   ACCO_z_bias   = CONFIG_Data.az      = 0;
-
-   GYRO_x_bias   = CONFIG_Data.gx      = 0;
-   GYRO_y_bias   = CONFIG_Data.gy      = 0;
-   GYRO_z_bias   = CONFIG_Data.gz      = 0;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      {
+      ACCO_x_bias[s] = CONFIG_Data.ax[s] = 0;
+      ACCO_y_bias[s] = CONFIG_Data.ay[s] = 0;
+      ACCO_z_bias[s] = CONFIG_Data.az[s] = 0;
+
+      GYRO_x_bias[s] = CONFIG_Data.gx[s] = 0;
+      GYRO_y_bias[s] = CONFIG_Data.gy[s] = 0;
+      GYRO_z_bias[s] = CONFIG_Data.gz[s] = 0;
+
+#if HAVE_TEMPCO
+      for (BYTE j = 0; j < GYRO_TEMP_POINTS; ++j)
+         {
+         GYRO_x_tempco[s][j] = CONFIG_Data.gtx[s][j] = 0;
+         GYRO_y_tempco[s][j] = CONFIG_Data.gty[s][j] = 0;
+         GYRO_z_tempco[s][j] = CONFIG_Data.gtz[s][j] = 0;
+         }
+#endif
+      }
 
    CAMERA_roll   = CONFIG_Data.roll    = 0;
    CAMERA_pitch  = CONFIG_Data.pitch   = 0;
@@ -39,6 +63,12 @@ CONFIG_init()
    SERVO_rgain   = CONFIG_Data.lgain   = 1;
 
    SERVO_reverse = CONFIG_Data.reverse = 0;
+
+#if HAVE_MAGNETOMETER
+   MAG_x_bias    = CONFIG_Data.mx      = 0;
+   MAG_y_bias    = CONFIG_Data.my      = 0;
+   MAG_z_bias    = CONFIG_Data.mz      = 0;
+#endif
    }
 
 void
@@ -47,13 +77,25 @@ CONFIG_save()
    CONFIG_Data.bat_k   = BATTERY_k;
    CONFIG_Data.center  = SERVO_center;
 
-   CONFIG_Data.ax      = ACCO_x_bias;
-   CONFIG_Data.ay      = ACCO_y_bias;
-   CONFIG_Data.az      = ACCO_z_bias;
-
-   CONFIG_Data.gx      = GYRO_x_bias;
-   CONFIG_Data.gy      = GYRO_y_bias;
-   CONFIG_Data.gz      = GYRO_z_bias;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      {
+      CONFIG_Data.ax[s] = ACCO_x_bias[s];
+      CONFIG_Data.ay[s] = ACCO_y_bias[s];
+      CONFIG_Data.az[s] = ACCO_z_bias[s];
+
+      CONFIG_Data.gx[s] = GYRO_x_bias[s];
+      CONFIG_Data.gy[s] = GYRO_y_bias[s];
+      CONFIG_Data.gz[s] = GYRO_z_bias[s];
+
+#if HAVE_TEMPCO
+      for (BYTE j = 0; j < GYRO_TEMP_POINTS; ++j)
+         {
+         CONFIG_Data.gtx[s][j] = GYRO_x_tempco[s][j];
+         CONFIG_Data.gty[s][j] = GYRO_y_tempco[s][j];
+         CONFIG_Data.gtz[s][j] = GYRO_z_tempco[s][j];
+         }
+#endif
+      }
 
    CONFIG_Data.roll    = CAMERA_roll;
    CONFIG_Data.pitch   = CAMERA_pitch;
@@ -64,6 +106,12 @@ CONFIG_save()
 
    CONFIG_Data.reverse = SERVO_reverse;
 
+#if HAVE_MAGNETOMETER
+   CONFIG_Data.mx      = MAG_x_bias;
+   CONFIG_Data.my      = MAG_y_bias;
+   CONFIG_Data.mz      = MAG_z_bias;
+#endif
+
    EEPROM_write_block(0, &CONFIG_Data, sizeof(CONFIG_Data));
    }
    
@@ -75,13 +123,25 @@ CONFIG_recall()
    BATTERY_k     = CONFIG_Data.bat_k;
    SERVO_center  = CONFIG_Data.center;
 
-   ACCO_x_bias   = CONFIG_Data.ax;
-   ACCO_y_bias   = CONFIG_Data.ay;
-   ACCO_z_bias   = CONFIG_Data.az;
-
-   GYRO_x_bias   = CONFIG_Data.gx;
-   GYRO_y_bias   = CONFIG_Data.gy;
-   GYRO_z_bias   = CONFIG_Data.gz;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      {
+      ACCO_x_bias[s] = CONFIG_Data.ax[s];
+      ACCO_y_bias[s] = CONFIG_Data.ay[s];
+      ACCO_z_bias[s] = CONFIG_Data.az[s];
+
+      GYRO_x_bias[s] = CONFIG_Data.gx[s];
+      GYRO_y_bias[s] = CONFIG_Data.gy[s];
+      GYRO_z_bias[s] = CONFIG_Data.gz[s];
+
+#if HAVE_TEMPCO
+      for (BYTE j = 0; j < GYRO_TEMP_POINTS; ++j)
+         {
+         GYRO_x_tempco[s][j] = CONFIG_Data.gtx[s][j];
+         GYRO_y_tempco[s][j] = CONFIG_Data.gty[s][j];
+         GYRO_z_tempco[s][j] = CONFIG_Data.gtz[s][j];
+         }
+#endif
+      }
 
    CAMERA_roll   = CONFIG_Data.roll;
    CAMERA_pitch  = CONFIG_Data.pitch;
@@ -91,4 +151,51 @@ CONFIG_recall()
    SERVO_rgain   = CONFIG_Data.rgain;
 
    SERVO_reverse = CONFIG_Data.reverse;
+
+#if HAVE_MAGNETOMETER
+   MAG_x_bias    = CONFIG_Data.mx;
+   MAG_y_bias    = CONFIG_Data.my;
+   MAG_z_bias    = CONFIG_Data.mz;
+#endif
+   }
+
+#if HAVE_TEMPCO
+// Bytes of the gyro bias model still to be written to eeprom by CONFIG_flush (0 = none).
+//
+WORD CONFIG_tempco_pending;
+
+// Begin saving the gyro bias model, leaving the rest of the eeprom record as it is.
+// The model sits at the end of the record, so it's written from "gtx" to there, a byte at a time by CONFIG_flush:
+// at ~3.3ms per byte, writing it all at once would stall the main loop for a few hundred ms.
+//
+void
+CONFIG_save_tempco()
+   {
+   DI();
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      for (BYTE j = 0; j < GYRO_TEMP_POINTS; ++j)
+         {
+         CONFIG_Data.gtx[s][j] = GYRO_x_tempco[s][j];
+         CONFIG_Data.gty[s][j] = GYRO_y_tempco[s][j];
+         CONFIG_Data.gtz[s][j] = GYRO_z_tempco[s][j];
+         }
+   EI();
+
+   CONFIG_tempco_pending = sizeof(CONFIG_Data) - ((BYTE *)CONFIG_Data.gtx - (BYTE *)&CONFIG_Data);
+   }
+
+// Write the next byte of a gyro bias model save, if the eeprom is ready for it.
+// Bytes that haven't changed aren't rewritten, to spare the eeprom.
+//
+void
+CONFIG_flush()
+   {
+   if (!CONFIG_tempco_pending || (EECR & (1 << EEPE)))
+      return;
+
+   WORD address = sizeof(CONFIG_Data) - CONFIG_tempco_pending--;
+   BYTE value   = ((BYTE *)&CONFIG_Data)[address];
+   if (EEPROM_read(address) != value)
+      EEPROM_write(address, value);
    }
+#endif
@@ -7,6 +7,7 @@
 // [Art 2] "Computing Euler Angles From Direction Cosines"                 http://gentlenav.googlecode.com/files/EulerAngles.pdf
 // [Art 3] "A Sensor Fusion Method for Smart phone Orientation Estimation" http://www.cms.livjm.ac.uk/pgnet2012/Proceedings/Papers/1569603133.pdf
 // [Art 4] "Tilt Sensing Using Linear Accelerometers"                      http://cache.freescale.com/files/sensors/doc/app_note/AN3461.pdf
+// [Art 5] "Strapdown Inertial Navigation Integration Algorithm Design Part 1: Attitude Algorithms", Paul G. Savage, J. Guidance 21(1) 1998
 //
 // We use "aerospace convention" for rotations throughout:
 // - x is roll  axis, points ahead, positive rotation == roll right
@@ -21,7 +22,124 @@
 #define IMU_RATE_THRESHOLD  DEG_TO_RAD(1.0) // drift correction snapshots are taken whenever turn rate is lower than this, in radians/sec
 #define IMU_RATE_DURATION   0.040           // ...for at least this long, in seconds
 #define IMU_TIME_CONSTANT   0.5             // time constant characterizing speed with which drift corrections are applied, in seconds
+#define IMU_BIAS_CONSTANT   30.0            // time constant characterizing speed with which persistent drift is learned as gyro bias, in seconds
+#define IMU_BIAS_LIMIT      DEG_TO_RAD(1.0) // largest gyro bias the drift corrector may learn, in radians/sec
+#define IMU_RENORM_TICKS    8               // orientation matrix is re-orthonormalized at least once every this many updates...
+#define IMU_RENORM_ERROR    1e-3            // ...or sooner, as soon as its orthogonality error exceeds this
+
+// Orientation update rate.
+// With HAVE_CONING, gyro samples are still taken at IMU_HZ, but are combined into one orientation update per HAVE_CONING samples.
+//
+#if HAVE_CONING
+#if HAVE_DMP
+#error  HAVE_CONING is not applicable with HAVE_DMP
+#endif
+#if IMU_HZ % HAVE_CONING
+#error  HAVE_CONING must divide IMU_HZ
+#endif
+#define IMU_UPDATE_HZ (IMU_HZ / HAVE_CONING)
+#else
+#define IMU_UPDATE_HZ IMU_HZ
+#endif
    
+#if HAVE_DMP && (HAVE_FIXED_DCM || HAVE_GRAVITY_VECTOR || HAVE_QUATERNION)
+#error  HAVE_FIXED_DCM, HAVE_GRAVITY_VECTOR, and HAVE_QUATERNION are not applicable with HAVE_DMP
+#endif
+
+#if HAVE_QUATERNION && (HAVE_FIXED_DCM || HAVE_GRAVITY_VECTOR)
+#error  HAVE_QUATERNION replaces the orientation matrix (no HAVE_FIXED_DCM or HAVE_GRAVITY_VECTOR)
+#endif
+
+#if HAVE_GRAVITY_VECTOR && HAVE_MAGNETOMETER
+#error  HAVE_MAGNETOMETER needs the full orientation matrix (no HAVE_GRAVITY_VECTOR)
+#endif
+
+#if HAVE_DMP
+// --------------------------------------------------------------------
+// Orientation tracking offloaded to the mpu's digital motion processor.
+//
+// The dmp integrates the gyros (and corrects their drift using its own accelerometers) on-chip, and MPU_update collects the
+// resulting quaternion. The matrix elements needed by the angle getters are computed from it on demand, outside of interrupts,
+// and our drift corrector is unused.
+// --------------------------------------------------------------------
+
+// Have we been aligned?
+//
+PRIVATE volatile BOOL IMU_aligned;
+
+// Apply drift correction? (Not applicable: the dmp does its own.)
+//
+PUBLIC  volatile BOOL IMU_apply_dc  = 1;
+
+// Fetch dmp orientation as a rotation matrix (in our axis conventions), in the form of the rows needed by the angle getters.
+// Taken:   places to put Rxx, Ryx, Rzx, Rzy, Rzz (any of them may be 0)
+//
+// Let M be the rotation that carries the sensor frame into the dmp's ground frame (x, y level, z up).
+// Ground axes in terms of the sensor frame are then M's rows. We use ground axes x, -y, -z (x ahead, y right, z down)
+// and, per GYRO_decode_xyz, body axes x = -sensor y, y = sensor z, z = -sensor x. Whence:
+//    Rxx = -Mxy,  Ryx = Myy,  Rzx = Mzy,  Rzy = -Mzz,  Rzz = Mzx
+//
+PRIVATE void
+IMU_getMatrix(FLOAT *rxx, FLOAT *ryx, FLOAT *rzx, FLOAT *rzy, FLOAT *rzz)
+   {
+   SWORD qw, qx, qy, qz;
+   GYRO_getQuaternion(&qw, &qx, &qy, &qz);
+
+   FLOAT w = qw * (1.0 / 16384), x = qx * (1.0 / 16384), y = qy * (1.0 / 16384), z = qz * (1.0 / 16384);
+
+   if (rxx) *rxx = - 2 * (x * y - w * z);         // -Mxy
+   if (ryx) *ryx =   1 - 2 * (x * x + z * z);     //  Myy
+   if (rzx) *rzx =   2 * (y * z + w * x);         //  Mzy
+   if (rzy) *rzy = - (1 - 2 * (x * x + y * y));   // -Mzz
+   if (rzz) *rzz =   2 * (x * z - w * y);         //  Mzx
+   }
+
+// Get the dmp-estimated orientation of the gyros with respect to ground, in radians, all as of the same instant.
+// Taken:    places to put roll, pitch, yaw angles (any of them may be 0)
+// Returned: 1 (a single fetch of the dmp's quaternion is always consistent)
+// Ref: [Art 2, Eqn 3]
+// Note: yaw is with respect to the heading at which the dmp started.
+//
+PUBLIC BOOL
+IMU_trySnapshot(FLOAT *roll, FLOAT *pitch, FLOAT *yaw)
+   {
+   FLOAT xx, yx, zx, zy, zz;
+   IMU_getMatrix(&xx, &yx, &zx, &zy, &zz);
+
+   if (roll)  *roll  =  FIXED_TO_FLOAT(CORDIC_atan2(FLOAT_TO_FIXED(zy), FLOAT_TO_FIXED(zz)));
+   if (pitch) *pitch = -FIXED_TO_FLOAT(CORDIC_asin(FLOAT_TO_FIXED(zx)));
+   if (yaw)   *yaw   =  FIXED_TO_FLOAT(CORDIC_atan2(FLOAT_TO_FIXED(yx), FLOAT_TO_FIXED(xx)));
+   return 1;
+   }
+
+PUBLIC void
+IMU_getSnapshot(FLOAT *roll, FLOAT *pitch, FLOAT *yaw)
+   {
+   IMU_trySnapshot(roll, pitch, yaw);
+   }
+
+// Align with ground reference.
+// With the dmp, roll and pitch come from gravity and need no alignment, so the "home" orientation is merely reported.
+//
+PUBLIC void
+IMU_align(FLOAT roll, FLOAT pitch, FLOAT yaw)
+   {
+   IMU_aligned = 1;
+   printf("imu=(%+.1f %+.1f %+.1f) [dmp]\n", RAD_TO_DEG(roll), RAD_TO_DEG(pitch), RAD_TO_DEG(yaw));
+   }
+
+// Update orientation.
+// Called by interrupt, in the ticker's bottom half.
+// Nothing to do: the dmp's quaternion has already been collected by MPU_update.
+// Returned: 0 (no timesteps to process)
+//
+PRIVATE BOOL
+IMU_update()
+   {
+   return 0;
+   }
+
+#else
 // --------------------------------------------------------------------
 // Interrupt communication area.
 //                                                                                                                                                
@@ -29,10 +147,83 @@
 // Columns are projections of gyro xyz axes on ground xyz axes.
 // Rows    are projections of ground xyz axes on gyro xyz axes.
 //                                                                                                                                                
+//
+// With HAVE_GRAVITY_VECTOR only the Z row is kept: it's the direction of gravity in the gyro frame, which is all that's needed for roll and pitch.
+//
+// With HAVE_QUATERNION the orientation is kept as a unit quaternion instead, and the matrix elements are computed from it as needed.
+//
+#if HAVE_QUATERNION
+// Quaternion elements (w = scalar part), in fixed point.
+//
+PRIVATE volatile FIXED Qw, Qx, Qy, Qz;
+
+// Matrix elements, in fixed point [http://en.wikipedia.org/wiki/Quaternions_and_spatial_rotation].
+//
+#define Fxx (FIXED_ONE - 2 * (FIXED_mul(Qy, Qy) + FIXED_mul(Qz, Qz)))
+#define Fxy (            2 * (FIXED_mul(Qx, Qy) - FIXED_mul(Qw, Qz)))
+#define Fxz (            2 * (FIXED_mul(Qx, Qz) + FIXED_mul(Qw, Qy)))
+#define Fyx (            2 * (FIXED_mul(Qx, Qy) + FIXED_mul(Qw, Qz)))
+#define Fyy (FIXED_ONE - 2 * (FIXED_mul(Qx, Qx) + FIXED_mul(Qz, Qz)))
+#define Fyz (            2 * (FIXED_mul(Qy, Qz) - FIXED_mul(Qw, Qx)))
+#define Fzx (            2 * (FIXED_mul(Qx, Qz) - FIXED_mul(Qw, Qy)))
+#define Fzy (            2 * (FIXED_mul(Qy, Qz) + FIXED_mul(Qw, Qx)))
+#define Fzz (FIXED_ONE - 2 * (FIXED_mul(Qx, Qx) + FIXED_mul(Qy, Qy)))
+
+// Matrix element, as a float or in the integrator's own format (IMU_ELEMENT), by name (xx..zz).
+//
+#define IMU_R(E) FIXED_TO_FLOAT(F##E)
+#define IMU_E(E) F##E
+typedef FIXED IMU_ELEMENT;
+#define IMU_ELEMENT_TO_FIXED(X) (X)
+#else
+#if HAVE_FIXED_DCM != 1
 PRIVATE volatile FLOAT
+#if !HAVE_GRAVITY_VECTOR
    Rxx, Rxy, Rxz,                                                                                                                                 
    Ryx, Ryy, Ryz,                                                                                                                                 
+#endif
    Rzx, Rzy, Rzz;                                                                                                                                 
+#endif
+
+#if HAVE_FIXED_DCM
+// The same, in fixed point.
+//
+PRIVATE volatile FIXED
+#if !HAVE_GRAVITY_VECTOR
+   Fxx, Fxy, Fxz,
+   Fyx, Fyy, Fyz,
+#endif
+   Fzx, Fzy, Fzz;
+
+// Matrix element, as a float or in the integrator's own format (IMU_ELEMENT), by name (xx..zz).
+//
+#define IMU_R(E) FIXED_TO_FLOAT(F##E)
+#define IMU_E(E) F##E
+typedef FIXED IMU_ELEMENT;
+#define IMU_ELEMENT_TO_FIXED(X) (X)
+#else
+#define IMU_R(E) R##E
+#define IMU_E(E) R##E
+typedef FLOAT IMU_ELEMENT;
+#define IMU_ELEMENT_TO_FIXED(X) FLOAT_TO_FIXED(X)
+#endif
+#endif
+
+#if HAVE_FIXED_DCM == 2
+// Largest difference between fixed and float matrix elements since last asked, for checking the fixed point integrator.
+//
+PRIVATE volatile FLOAT IMU_fixedError;
+#endif
+
+#if !HAVE_DMP && !HAVE_GRAVITY_VECTOR && !HAVE_QUATERNION
+// Largest orthogonality error of orientation matrix since last asked, for checking the re-orthonormalization schedule.
+//
+#if HAVE_FIXED_DCM
+PRIVATE volatile FIXED IMU_orthoError;
+#else
+PRIVATE volatile FLOAT IMU_orthoError;
+#endif
+#endif
                                                                                                                                                   
 // Reference angles identifying "home" orientation, in radians.
 // The drift corrector will drive the rotation matrix towards this orientation whenever the bike is upright.
@@ -42,6 +233,18 @@ PRIVATE volatile FLOAT IMU_rollReference, IMU_pitchReference;
 // Estimated drift error awaiting correction, in radians.
 //                                                                                                                                                
 PRIVATE volatile FLOAT IMU_rollError, IMU_pitchError, IMU_yawError;
+
+// Gyro bias remaining after sensor calibration, as learned by drift corrector from its repeated error estimates, in radians/sec.
+//
+PRIVATE volatile FLOAT IMU_rollBias, IMU_pitchBias, IMU_yawBias;
+
+#if HAVE_MAGNETOMETER
+// Heading of magnetic field with respect to ground reference frame, as first measured after alignment, in radians.
+// The drift corrector will hold the rotation matrix to this heading.
+//
+PRIVATE volatile FLOAT IMU_headingReference;
+PRIVATE volatile BOOL  IMU_headingReferenced;
+#endif
                                                                                                                                                   
 // Have all the above values been set (ie. by IMU_align)?                                                                                         
 //                                                                                                                                                
@@ -50,25 +253,84 @@ PRIVATE volatile BOOL IMU_aligned;
 // Apply drift correction?
 //                                                                                                                                                
 PUBLIC  volatile BOOL IMU_apply_dc  = 1; 
+
+// Orientation as of the latest update, published for IMU_getSnapshot: just the matrix elements it needs.
+// They're kept in the integrator's own format, so publishing is a plain copy, and only readers convert (to fixed point, for the cordic),
+// at their own rate, and only the elements they use.
+//
+// Readers copy it without disabling interrupts. Instead, it's guarded by a sequence count (a "seqlock"): the integrator makes the count odd
+// while it rewrites the elements, and even again when they're complete, so a copy is consistent if the count was the same, and even,
+// before and after it was taken.
+//
+PRIVATE volatile BYTE IMU_seq;
+PRIVATE volatile struct
+   {
+   IMU_ELEMENT zx, zy, zz;
+#if !HAVE_GRAVITY_VECTOR
+   IMU_ELEMENT yx, xx;
+#endif
+   } IMU_published;
 // --------------------------------------------------------------------
 
+// Sine and cosine of an angle, in radians.
+//
+PRIVATE void
+IMU_sincos(FLOAT a, FLOAT *s, FLOAT *c)
+   {
+   FIXED fs, fc;
+   CORDIC_sincos(FLOAT_TO_FIXED(a), &fs, &fc);
+   *s = FIXED_TO_FLOAT(fs);
+   *c = FIXED_TO_FLOAT(fc);
+   }
+
+// Publish current orientation for IMU_getSnapshot.
+// Called by interrupt (or with interrupts disabled), so main loop readers can't run while it's in progress, but can be preempted by it.
+//
+PRIVATE void
+IMU_publish()
+   {
+   IMU_seq += 1; // odd: update in progress
+   IMU_published.zx = IMU_E(zx);
+   IMU_published.zy = IMU_E(zy);
+   IMU_published.zz = IMU_E(zz);
+#if !HAVE_GRAVITY_VECTOR
+   IMU_published.yx = IMU_E(yx);
+   IMU_published.xx = IMU_E(xx);
+#endif
+   IMU_seq += 1; // even: update complete
+   }
+
 // Initialize the orientation matrix.
 // Taken:   gyro's orientation with respect to ground, in radians
-// Updated: Rxx..Rzz
+// Updated: Rxx..Rzz (or Qw..Qz)
 // Ref: [Art 2, Eqn 2] and [http://en.wikipedia.org/wiki/Rotation_matrix]
 //
 PRIVATE void
 IMU_set(FLOAT roll, FLOAT pitch, FLOAT yaw)
    {
+#if HAVE_QUATERNION
+   // The same yaw, pitch, roll sequence, as a product of quaternions, each made from half of its rotation angle.
+   // Ref: [http://en.wikipedia.org/wiki/Conversion_between_quaternions_and_Euler_angles]
+   //
+   FLOAT sinR, cosR, sinP, cosP, sinY, cosY;
+   IMU_sincos(roll  / 2, &sinR, &cosR);
+   IMU_sincos(pitch / 2, &sinP, &cosP);
+   IMU_sincos(yaw   / 2, &sinY, &cosY);
+
    FLOAT
-  
-   R = roll,
-   P = pitch,
-   Y = yaw,
-   
-   sinR = sin(R), cosR = cos(R),
-   sinP = sin(P), cosP = cos(P),
-   sinY = sin(Y), cosY = cos(Y);
+   w = cosR * cosP * cosY + sinR * sinP * sinY,
+   x = sinR * cosP * cosY - cosR * sinP * sinY,
+   y = cosR * sinP * cosY + sinR * cosP * sinY,
+   z = cosR * cosP * sinY - sinR * sinP * cosY;
+#else
+   FLOAT sinR, cosR, sinP, cosP;
+   IMU_sincos(roll,  &sinR, &cosR);
+   IMU_sincos(pitch, &sinP, &cosP);
+
+#if !HAVE_GRAVITY_VECTOR
+   FLOAT sinY, cosY;
+   IMU_sincos(yaw,   &sinY, &cosY);
+#endif
 
    // The full rotation matrix, R, is formed by applying individual axis rotations in yaw, pitch, roll order.
    // We do this by premultiplying, right to left:
@@ -78,11 +340,37 @@ IMU_set(FLOAT roll, FLOAT pitch, FLOAT yaw)
    //    Rr = 0 cosP -sinP     Rp =    0  1    0    Ry =  sinY  cosY 0
    //         0 sinP  cosP         -sinR  0 cosR             0    0  1
 
+   FLOAT
+#if !HAVE_GRAVITY_VECTOR
+   xx = cosP * cosY, xy = sinR * sinP * cosY - cosR * sinY, xz = cosR * sinP * cosY + sinR * sinY,
+   yx = cosP * sinY, yy = sinY * sinP * sinY + cosR * cosY, yz = cosR * sinP * sinY - sinR * cosY,
+#endif
+   zx = -sinP,       zy = sinR * cosP,                      zz = cosR * cosP;
+#endif
+
    DI();
    
-   Rxx = cosP * cosY; Rxy = sinR * sinP * cosY - cosR * sinY; Rxz = cosR * sinP * cosY + sinR * sinY;
-   Ryx = cosP * sinY; Ryy = sinY * sinP * sinY + cosR * cosY; Ryz = cosR * sinP * sinY - sinR * cosY;
-   Rzx = -sinP;       Rzy = sinR * cosP;                      Rzz = cosR * cosP;
+#if HAVE_QUATERNION
+   Qw = FLOAT_TO_FIXED(w); Qx = FLOAT_TO_FIXED(x); Qy = FLOAT_TO_FIXED(y); Qz = FLOAT_TO_FIXED(z);
+#else
+#if HAVE_FIXED_DCM != 1
+#if !HAVE_GRAVITY_VECTOR
+   Rxx = xx; Rxy = xy; Rxz = xz;
+   Ryx = yx; Ryy = yy; Ryz = yz;
+#endif
+   Rzx = zx; Rzy = zy; Rzz = zz;
+#endif
+#if HAVE_FIXED_DCM
+#if !HAVE_GRAVITY_VECTOR
+   Fxx = FLOAT_TO_FIXED(xx); Fxy = FLOAT_TO_FIXED(xy); Fxz = FLOAT_TO_FIXED(xz);
+   Fyx = FLOAT_TO_FIXED(yx); Fyy = FLOAT_TO_FIXED(yy); Fyz = FLOAT_TO_FIXED(yz);
+#endif
+   Fzx = FLOAT_TO_FIXED(zx); Fzy = FLOAT_TO_FIXED(zy); Fzz = FLOAT_TO_FIXED(zz);
+#endif
+#if HAVE_FIXED_DCM == 2
+   IMU_fixedError = 0;
+#endif
+#endif
 
    IMU_rollReference  = roll;
    IMU_pitchReference = pitch;
@@ -90,40 +378,60 @@ IMU_set(FLOAT roll, FLOAT pitch, FLOAT yaw)
    IMU_rollError  = 0;
    IMU_pitchError = 0;
    IMU_yawError   = 0;
+
+   IMU_rollBias   = 0;
+   IMU_pitchBias  = 0;
+   IMU_yawBias    = 0;
+
+#if HAVE_MAGNETOMETER
+   IMU_headingReferenced = 0;
+#endif
+
+   IMU_publish();
    
    EI();
    }
 
-// Get the integrator-estimated orientation of the gyros with respect to ground, in radians.
+// Get the integrator-estimated orientation of the gyros with respect to ground, in radians, all as of the same update, if it can be had at once.
+// Taken:    places to put roll, pitch, yaw angles (any of them may be 0)
+// Returned: 1 = angles set, 0 = an update was published during the copy (angles untouched)
 // Ref: [Art 2, Eqn 3]
 //
-PUBLIC FLOAT
-IMU_getRollAngle()
-   { 
-   DI();
-   FLOAT a = Rzy;
-   FLOAT b = Rzz;
-   EI();
-   return atan2(a, b);
+// Interrupts are left enabled. An interrupt handler that can preempt IMU_publish (ie. that can run during the ticker's bottom half)
+// must take a failure as "keep using the previous angles": retrying would wait forever for the update it interrupted.
+//
+PUBLIC BOOL
+IMU_trySnapshot(FLOAT *roll, FLOAT *pitch, FLOAT *yaw)
+   {
+   BYTE        seq = IMU_seq;
+   IMU_ELEMENT zx  = IMU_published.zx;
+   IMU_ELEMENT zy  = IMU_published.zy;
+   IMU_ELEMENT zz  = IMU_published.zz;
+#if !HAVE_GRAVITY_VECTOR
+   IMU_ELEMENT yx  = IMU_published.yx;
+   IMU_ELEMENT xx  = IMU_published.xx;
+#endif
+   if ((seq & 1) || seq != IMU_seq)
+      return 0;
+
+   if (roll)  *roll  =  FIXED_TO_FLOAT(CORDIC_atan2(IMU_ELEMENT_TO_FIXED(zy), IMU_ELEMENT_TO_FIXED(zz)));
+   if (pitch) *pitch = -FIXED_TO_FLOAT(CORDIC_asin(IMU_ELEMENT_TO_FIXED(zx)));
+#if HAVE_GRAVITY_VECTOR
+   if (yaw)   *yaw   =  0; // not tracked
+#else
+   if (yaw)   *yaw   =  FIXED_TO_FLOAT(CORDIC_atan2(IMU_ELEMENT_TO_FIXED(yx), IMU_ELEMENT_TO_FIXED(xx)));
+#endif
+   return 1;
    }
 
-PUBLIC FLOAT
-IMU_getPitchAngle()
+// The same, waiting out any update in progress.
+// Not for use by interrupt handlers [see IMU_trySnapshot].
+//
+PUBLIC void
+IMU_getSnapshot(FLOAT *roll, FLOAT *pitch, FLOAT *yaw)
    {
-   DI();
-   FLOAT a = Rzx;
-   EI();
-   return -asin(a);
-   } 
-
-PUBLIC FLOAT
-IMU_getYawAngle()
-   { 
-   DI();
-   FLOAT a = Ryx;
-   FLOAT b = Rxx;
-   EI();
-   return atan2(a, b);
+   while (!IMU_trySnapshot(roll, pitch, yaw))
+      ;
    }
 
 // Align orientation matrix and gyros with respect to each other and with respect to ground reference.
@@ -139,6 +447,73 @@ IMU_align(FLOAT roll, FLOAT pitch, FLOAT yaw)
    printf("imu=(%+.1f %+.1f %+.1f)\n", RAD_TO_DEG(roll), RAD_TO_DEG(pitch), RAD_TO_DEG(yaw));
    }
 
+#if HAVE_FIXED_DCM != 1 && !HAVE_GRAVITY_VECTOR && !HAVE_QUATERNION
+// Re-orthonormalize orientation matrix.
+// Called by interrupt.
+//
+// Updated: Rxx..Rzz
+//
+PRIVATE void
+IMU_renormalize()
+   {
+   // Re-orthonormalize the matrix with the following objectives:
+   // The dot product of the X & Y rows should be zero.
+   // The Z row should be equal to the cross product of the X & Y rows.
+   // Each row should be of unit magnitude.
+   //
+   // The idea is that the three rows and columns will always be approximately perpendicular, because we are going to maintain them that
+   // way, and we are going to maintain their lengths to be one, but we will need to fix up slight rotational errors.
+   // For example, suppose vectors A and B are almost, but not exactly perpendicular, and we want to adjust them to make them closer to perpendicular.
+   // We do not want to change their magnitude, we just want to rotate them. That means the adjustment to each of them is perpendicular.
+   // Since B is perpendicular to A, when we want to rotate A a little bit, we simply add a portion of B. And vice-versa when we want to rotate B.
+   //
+   // So we take the dot product of the X and Y rows to find out if they are perpendicular. If they are, the dot product will be zero.
+   // If they are not, the dot product will be measure of how much they need to be rotated toward or away from each other to be perpendicular.
+   // Since we have no way of knowing whether X or Y are more likely to be correct, we split the difference, and adjust both X and Y by half.
+   
+   // Measure how much rows X and Y are rotated towards each other [Art 1, Eqn 18].
+   //
+   FLOAT dot = Rxx * Ryx + Rxy * Ryy + Rxz * Ryz;
+   
+   // Now rotate each away from the other by half that amount, thereby restoring their orthogonality [Art 1, Eqn 19].
+   //
+   FLOAT half = .5 * dot;
+
+   // temporary copy of row X
+   FLOAT
+   Txx =  Rxx,
+   Txy =  Rxy,
+   Txz =  Rxz;
+
+   // rotate row X away from Y
+   Rxx -= half * Ryx;
+   Rxy -= half * Ryy;
+   Rxz -= half * Ryz;
+
+   // rotate row Y away from X
+   Ryx -= half * Txx;
+   Ryy -= half * Txy;
+   Ryz -= half * Txz;
+
+   // Set row Z to cross product of X and Y rows [Art 1, Eqn 20].
+   //
+   Rzx = Rxy * Ryz - Rxz * Ryy;
+   Rzy = Rxz * Ryx - Rxx * Ryz;
+   Rzz = Rxx * Ryy - Rxy * Ryx;
+
+   // Normalize each row by dividing each element by the row's magnitude (square root of sum of squares)
+   // noting that, since the magnitude should be approximately 1, we can use a short Taylor expansion
+   // to compute the reciprocal square root:    1/sqrt(x) ~=  1/2 * (3 - x) for x ~= 1
+   //
+   FLOAT nx = .5 * (3 - (Rxx * Rxx + Rxy * Rxy + Rxz * Rxz));
+   FLOAT ny = .5 * (3 - (Ryx * Ryx + Ryy * Ryy + Ryz * Ryz));
+   FLOAT nz = .5 * (3 - (Rzx * Rzx + Rzy * Rzy + Rzz * Rzz));
+
+   Rxx *= nx; Rxy *= nx; Rxz *= nx;
+   Ryx *= ny; Ryy *= ny; Ryz *= ny;
+   Rzx *= nz; Rzy *= nz; Rzz *= nz;
+   }
+
 // Rotate orientation matrix to follow gyro's motion.
 // Called by interrupt.
 //
@@ -176,11 +551,25 @@ IMU_rotate(FLOAT dx, FLOAT dy, FLOAT dz)
    //
    // [Art 1, Eqn 17]
    //
+   // With HAVE_CONING, Q also carries its second order terms, which are no longer negligible at the larger rotations of a combined update
+   // (over one update the truncation error is third order, as for the coning correction itself) [Art 5]:
+   //
+   //             1 - (dy^2 + dz^2) / 2      -dz + dx * dy / 2        dy + dx * dz / 2
+   //       Q  =   dz + dx * dy / 2        1 - (dx^2 + dz^2) / 2     -dx + dy * dz / 2
+   //            -dy + dx * dz / 2          dx + dy * dz / 2       1 - (dx^2 + dy^2) / 2
+   //
 
+#if HAVE_CONING
+   FLOAT
+   Qxx = 1 - .5 * (dy * dy + dz * dz),  Qxy = -dz + .5 * dx * dy,          Qxz =  dy + .5 * dx * dz,
+   Qyx =  dz + .5 * dx * dy,          Qyy = 1 - .5 * (dx * dx + dz * dz),  Qyz = -dx + .5 * dy * dz,
+   Qzx = -dy + .5 * dx * dz,          Qzy =  dx + .5 * dy * dz,          Qzz = 1 - .5 * (dx * dx + dy * dy);
+#else
    FLOAT
    Qxx =   1,  Qxy = -dz,  Qxz =  dy,
    Qyx =  dz,  Qyy =   1,  Qyz = -dx,
    Qzx = -dy,  Qzy =  dx,  Qzz =   1;
+#endif
    
    FLOAT
    Txx = Rxx * Qxx + Rxy * Qyx + Rxz * Qzx,  Txy = Rxx * Qxy + Rxy * Qyy + Rxz * Qzy,  Txz = Rxx * Qxz + Rxy * Qyz + Rxz * Qzz,
@@ -191,77 +580,385 @@ IMU_rotate(FLOAT dx, FLOAT dy, FLOAT dz)
    Ryx = Tyx;  Ryy = Tyy;  Ryz = Tyz;
    Rzx = Tzx;  Rzy = Tzy;  Rzz = Tzz;
 
-   // Re-orthonormalize the matrix with the following objectives:
-   // The dot product of the X & Y rows should be zero.
-   // The Z row should be equal to the cross product of the X & Y rows.
-   // Each row should be of unit magnitude.
+   // Each update leaves the matrix only slightly less orthonormal than before, so rather than repairing it every time,
+   // measure the damage (9 multiplies, against IMU_renormalize's 33) and repair it every so often.
    //
-   // The idea is that the three rows and columns will always be approximately perpendicular, because we are going to maintain them that
-   // way, and we are going to maintain their lengths to be one, but we will need to fix up slight rotational errors.
-   // For example, suppose vectors A and B are almost, but not exactly perpendicular, and we want to adjust them to make them closer to perpendicular.
-   // We do not want to change their magnitude, we just want to rotate them. That means the adjustment to each of them is perpendicular.
-   // Since B is perpendicular to A, when we want to rotate A a little bit, we simply add a portion of B. And vice-versa when we want to rotate B.
+   // The measure is the dot product of rows X and Y, ideally 0 [Art 1, Eqn 18],
+   // plus the departures of rows X and Y's squared lengths from 1, which IMU_renormalize corrects [Art 1, Eqn 21].
+   // Row Z is rebuilt from X and Y, so needn't be measured.
    //
-   // So we take the dot product of the X and Y rows to find out if they are perpendicular. If they are, the dot product will be zero.
-   // If they are not, the dot product will be measure of how much they need to be rotated toward or away from each other to be perpendicular.
-   // Since we have no way of knowing whether X or Y are more likely to be correct, we split the difference, and adjust both X and Y by half.
-   
-   // Measure how much rows X and Y are rotated towards each other [Art 1, Eqn 18].
+   FLOAT e = fabs(Rxx * Ryx + Rxy * Ryy + Rxz * Ryz)
+           + fabs(1 - (Rxx * Rxx + Rxy * Rxy + Rxz * Rxz))
+           + fabs(1 - (Ryx * Ryx + Ryy * Ryy + Ryz * Ryz));
+#if !HAVE_FIXED_DCM
+   if (e > IMU_orthoError)
+      IMU_orthoError = e;
+#endif
+
+   static BYTE ticks;
+   if (++ticks >= IMU_RENORM_TICKS || e > IMU_RENORM_ERROR)
+      {
+      IMU_renormalize();
+      ticks = 0;
+      }
+   }
+#endif
+
+#if HAVE_FIXED_DCM && !HAVE_GRAVITY_VECTOR
+// Re-orthonormalize orientation matrix, in fixed point.
+// Called by interrupt.
+//
+// Updated: Fxx..Fzz
+//
+PRIVATE void
+IMU_renormalizeFixed()
+   {
+   // Rotate rows X and Y away from each other by half their dot product [Art 1, Eqn 18, 19].
    //
-   FLOAT dot = Rxx * Ryx + Rxy * Ryy + Rxz * Ryz;
-   
-   // Now rotate each away from the other by half that amount, thereby restoring their orthogonality [Art 1, Eqn 19].
+   FIXED
+   Txx = Fxx,  Txy = Fxy,  Txz = Fxz,
+   Tyx = Fyx,  Tyy = Fyy,  Tyz = Fyz;
+
+   FIXED half = (FIXED_mul(Txx, Tyx) + FIXED_mul(Txy, Tyy) + FIXED_mul(Txz, Tyz)) >> 1;
+
+   FIXED
+   Xx = Txx - FIXED_mul(half, Tyx),  Xy = Txy - FIXED_mul(half, Tyy),  Xz = Txz - FIXED_mul(half, Tyz),
+   Yx = Tyx - FIXED_mul(half, Txx),  Yy = Tyy - FIXED_mul(half, Txy),  Yz = Tyz - FIXED_mul(half, Txz);
+
+   // Set row Z to cross product of X and Y rows [Art 1, Eqn 20].
    //
-   FLOAT half = .5 * dot;
+   FIXED
+   Zx = FIXED_mul(Xy, Yz) - FIXED_mul(Xz, Yy),
+   Zy = FIXED_mul(Xz, Yx) - FIXED_mul(Xx, Yz),
+   Zz = FIXED_mul(Xx, Yy) - FIXED_mul(Xy, Yx);
 
-   // temporary copy of row X
-   Txx =  Rxx;
-   Txy =  Rxy;
-   Txz =  Rxz;
+   // Normalize each row:    1/sqrt(x) ~= 1 + (1 - x) / 2 for x ~= 1
+   //
+   FIXED nx = FIXED_ONE + ((FIXED_ONE - (FIXED_mul(Xx, Xx) + FIXED_mul(Xy, Xy) + FIXED_mul(Xz, Xz))) >> 1);
+   FIXED ny = FIXED_ONE + ((FIXED_ONE - (FIXED_mul(Yx, Yx) + FIXED_mul(Yy, Yy) + FIXED_mul(Yz, Yz))) >> 1);
+   FIXED nz = FIXED_ONE + ((FIXED_ONE - (FIXED_mul(Zx, Zx) + FIXED_mul(Zy, Zy) + FIXED_mul(Zz, Zz))) >> 1);
 
-   // rotate row X away from Y
-   Rxx -= half * Ryx;
-   Rxy -= half * Ryy;
-   Rxz -= half * Ryz;
+   Fxx = FIXED_mul(Xx, nx); Fxy = FIXED_mul(Xy, nx); Fxz = FIXED_mul(Xz, nx);
+   Fyx = FIXED_mul(Yx, ny); Fyy = FIXED_mul(Yy, ny); Fyz = FIXED_mul(Yz, ny);
+   Fzx = FIXED_mul(Zx, nz); Fzy = FIXED_mul(Zy, nz); Fzz = FIXED_mul(Zz, nz);
+   }
 
-   // rotate row Y away from X
-   Ryx -= half * Txx;
-   Ryy -= half * Txy;
-   Ryz -= half * Txz;
+// Rotate orientation matrix to follow gyro's motion, in fixed point.
+// Called by interrupt.
+//
+// Taken:   differential rotations of gyro around its axes, in radians
+// Updated: Fxx..Fzz
+//
+// This is IMU_rotate, step for step, with each float multiply replaced by FIXED_mul (each four 16x16 hardware multiplies).
+//
+PRIVATE void
+IMU_rotateFixed(FIXED dx, FIXED dy, FIXED dz)
+   {
+   // R(t + dt) = R(t) * Q, with Q's unit diagonal applied by addition [Art 1, Eqn 17].
+   // Writing Q = 1 + S, the first order change is R * S.
+   //
+   FIXED
+   Sxx = FIXED_mul(Fxy, dz) - FIXED_mul(Fxz, dy),  Sxy = FIXED_mul(Fxz, dx) - FIXED_mul(Fxx, dz),  Sxz = FIXED_mul(Fxx, dy) - FIXED_mul(Fxy, dx),
+   Syx = FIXED_mul(Fyy, dz) - FIXED_mul(Fyz, dy),  Syy = FIXED_mul(Fyz, dx) - FIXED_mul(Fyx, dz),  Syz = FIXED_mul(Fyx, dy) - FIXED_mul(Fyy, dx),
+   Szx = FIXED_mul(Fzy, dz) - FIXED_mul(Fzz, dy),  Szy = FIXED_mul(Fzz, dx) - FIXED_mul(Fzx, dz),  Szz = FIXED_mul(Fzx, dy) - FIXED_mul(Fzy, dx);
 
-   // Set row Z to cross product of X and Y rows [Art 1, Eqn 20].
+#if HAVE_CONING
+   // Second order change, (R * S) * S / 2 (see IMU_rotate).
    //
-   Rzx = Rxy * Ryz - Rxz * Ryy;
-   Rzy = Rxz * Ryx - Rxx * Ryz;
-   Rzz = Rxx * Ryy - Rxy * Ryx;
+   dx >>= 1; dy >>= 1; dz >>= 1;
+   Fxx += Sxx + FIXED_mul(Sxy, dz) - FIXED_mul(Sxz, dy);  Fxy += Sxy + FIXED_mul(Sxz, dx) - FIXED_mul(Sxx, dz);  Fxz += Sxz + FIXED_mul(Sxx, dy) - FIXED_mul(Sxy, dx);
+   Fyx += Syx + FIXED_mul(Syy, dz) - FIXED_mul(Syz, dy);  Fyy += Syy + FIXED_mul(Syz, dx) - FIXED_mul(Syx, dz);  Fyz += Syz + FIXED_mul(Syx, dy) - FIXED_mul(Syy, dx);
+   Fzx += Szx + FIXED_mul(Szy, dz) - FIXED_mul(Szz, dy);  Fzy += Szy + FIXED_mul(Szz, dx) - FIXED_mul(Szx, dz);  Fzz += Szz + FIXED_mul(Szx, dy) - FIXED_mul(Szy, dx);
+#else
+   Fxx += Sxx;  Fxy += Sxy;  Fxz += Sxz;
+   Fyx += Syx;  Fyy += Syy;  Fyz += Syz;
+   Fzx += Szx;  Fzy += Szy;  Fzz += Szz;
+#endif
 
-   // Normalize each row by dividing each element by the row's magnitude (square root of sum of squares)
-   // noting that, since the magnitude should be approximately 1, we can use a short Taylor expansion
-   // to compute the reciprocal square root:    1/sqrt(x) ~=  1/2 * (3 - x) for x ~= 1
+   // Re-orthonormalize on IMU_rotate's schedule.
    //
-   FLOAT nx = .5 * (3 - (Rxx * Rxx + Rxy * Rxy + Rxz * Rxz));
-   FLOAT ny = .5 * (3 - (Ryx * Ryx + Ryy * Ryy + Ryz * Ryz));
-   FLOAT nz = .5 * (3 - (Rzx * Rzx + Rzy * Rzy + Rzz * Rzz));
+   FIXED d = FIXED_mul(Fxx, Fyx) + FIXED_mul(Fxy, Fyy) + FIXED_mul(Fxz, Fyz);
+   FIXED nx = FIXED_ONE - (FIXED_mul(Fxx, Fxx) + FIXED_mul(Fxy, Fxy) + FIXED_mul(Fxz, Fxz));
+   FIXED ny = FIXED_ONE - (FIXED_mul(Fyx, Fyx) + FIXED_mul(Fyy, Fyy) + FIXED_mul(Fyz, Fyz));
+   FIXED e = (d < 0 ? -d : d) + (nx < 0 ? -nx : nx) + (ny < 0 ? -ny : ny);
+   if (e > IMU_orthoError)
+      IMU_orthoError = e;
 
-   Rxx *= nx; Rxy *= nx; Rxz *= nx;
-   Ryx *= ny; Ryy *= ny; Ryz *= ny;
-   Rzx *= nz; Rzy *= nz; Rzz *= nz;
+   static BYTE ticks;
+   if (++ticks >= IMU_RENORM_TICKS || e > FLOAT_TO_FIXED(IMU_RENORM_ERROR))
+      {
+      IMU_renormalizeFixed();
+      ticks = 0;
+      }
    }
+#endif
 
-// Update orientation matrix in step with gyro's motions and apply drift corrections.
-// Called by interrupt at a rate of IMU_HZ.
+#if HAVE_GRAVITY_VECTOR
+// Rotate gravity vector (Z row of orientation matrix) to follow gyro's motion.
+// Called by interrupt.
 //
+// Taken:   differential rotations of gyro around its axes, in radians
+// Updated: Rzx, Rzy, Rzz (or, with HAVE_FIXED_DCM, Fzx, Fzy, Fzz)
+//
+// This is the Z row of IMU_rotate's R * Q. Since the X and Y rows aren't kept, there's no orthogonality to restore,
+// only the vector's length. That's 12 multiplies instead of IMU_rotate's 33 (plus 33 more whenever it re-orthonormalizes).
+//
+#if HAVE_FIXED_DCM != 1
 PRIVATE void
-IMU_update()
+IMU_rotate(FLOAT dx, FLOAT dy, FLOAT dz)
    {
-   if (!IMU_aligned)
-      return;
+   // [Art 1, Eqn 17]
+   //
+   FLOAT
+   Sx = Rzy * dz - Rzz * dy,
+   Sy = Rzz * dx - Rzx * dz,
+   Sz = Rzx * dy - Rzy * dx;
+
+#if HAVE_CONING
+   // Second order change (see IMU_rotate).
+   //
+   FLOAT
+   Zx = Rzx + Sx + .5 * (Sy * dz - Sz * dy),
+   Zy = Rzy + Sy + .5 * (Sz * dx - Sx * dz),
+   Zz = Rzz + Sz + .5 * (Sx * dy - Sy * dx);
+#else
+   FLOAT
+   Zx = Rzx + Sx,
+   Zy = Rzy + Sy,
+   Zz = Rzz + Sz;
+#endif
+
+   // Normalize:    1/sqrt(x) ~= 1/2 * (3 - x) for x ~= 1
+   //
+   FLOAT n = .5 * (3 - (Zx * Zx + Zy * Zy + Zz * Zz));
+
+   Rzx = Zx * n; Rzy = Zy * n; Rzz = Zz * n;
+   }
+#endif
+
+#if HAVE_FIXED_DCM
+PRIVATE void
+IMU_rotateFixed(FIXED dx, FIXED dy, FIXED dz)
+   {
+   FIXED
+   Sx = FIXED_mul(Fzy, dz) - FIXED_mul(Fzz, dy),
+   Sy = FIXED_mul(Fzz, dx) - FIXED_mul(Fzx, dz),
+   Sz = FIXED_mul(Fzx, dy) - FIXED_mul(Fzy, dx);
+
+#if HAVE_CONING
+   dx >>= 1; dy >>= 1; dz >>= 1;
+   FIXED
+   Zx = Fzx + Sx + FIXED_mul(Sy, dz) - FIXED_mul(Sz, dy),
+   Zy = Fzy + Sy + FIXED_mul(Sz, dx) - FIXED_mul(Sx, dz),
+   Zz = Fzz + Sz + FIXED_mul(Sx, dy) - FIXED_mul(Sy, dx);
+#else
+   FIXED
+   Zx = Fzx + Sx,
+   Zy = Fzy + Sy,
+   Zz = Fzz + Sz;
+#endif
 
+   FIXED n = FIXED_ONE + ((FIXED_ONE - (FIXED_mul(Zx, Zx) + FIXED_mul(Zy, Zy) + FIXED_mul(Zz, Zz))) >> 1);
+
+   Fzx = FIXED_mul(Zx, n); Fzy = FIXED_mul(Zy, n); Fzz = FIXED_mul(Zz, n);
+   }
+#endif
+#endif
+
+#if HAVE_QUATERNION
+// Rotate orientation quaternion to follow gyro's motion.
+// Called by interrupt.
+//
+// Taken:   differential rotations of gyro around its axes, in radians
+// Updated: Qw..Qz
+//
+// The counterpart of IMU_rotate's R * Q is q * dq, where dq ~= (1, dx/2, dy/2, dz/2) is the differential rotation.
+// The only constraint to restore afterwards is unit length. That's 20 multiplies instead of IMU_rotate's 33 (plus renormalization), and 4 values instead of 9.
+// Normalizing also corrects dq's second order term (dq's w being short by |d|^2 / 8), so unlike the matrix, this needs nothing extra for HAVE_CONING.
+//
+PRIVATE void
+IMU_rotateFixed(FIXED dx, FIXED dy, FIXED dz)
+   {
+   dx >>= 1;
+   dy >>= 1;
+   dz >>= 1;
+
+   FIXED
+   w = Qw - FIXED_mul(Qx, dx) - FIXED_mul(Qy, dy) - FIXED_mul(Qz, dz),
+   x = Qx + FIXED_mul(Qw, dx) + FIXED_mul(Qy, dz) - FIXED_mul(Qz, dy),
+   y = Qy + FIXED_mul(Qw, dy) + FIXED_mul(Qz, dx) - FIXED_mul(Qx, dz),
+   z = Qz + FIXED_mul(Qw, dz) + FIXED_mul(Qx, dy) - FIXED_mul(Qy, dx);
+
+   // Normalize:    1/sqrt(x) ~= 1 + (1 - x) / 2 for x ~= 1
+   //
+   FIXED n = FIXED_ONE + ((FIXED_ONE - (FIXED_mul(w, w) + FIXED_mul(x, x) + FIXED_mul(y, y) + FIXED_mul(z, z))) >> 1);
+
+   Qw = FIXED_mul(w, n); Qx = FIXED_mul(x, n); Qy = FIXED_mul(y, n); Qz = FIXED_mul(z, n);
+   }
+#endif
+
+#if HAVE_FIXED_DCM == 2
+// Compare fixed and float matrices, noting largest difference.
+// Called by interrupt.
+//
+PRIVATE void
+IMU_compareFixed()
+   {
+   FLOAT d[] = {
+#if !HAVE_GRAVITY_VECTOR
+      IMU_R(xx) - Rxx, IMU_R(xy) - Rxy, IMU_R(xz) - Rxz,
+      IMU_R(yx) - Ryx, IMU_R(yy) - Ryy, IMU_R(yz) - Ryz,
+#endif
+      IMU_R(zx) - Rzx, IMU_R(zy) - Rzy, IMU_R(zz) - Rzz
+      };
+   for (BYTE i = 0; i < sizeof(d) / sizeof(d[0]); ++i)
+      if (fabs(d[i]) > IMU_fixedError)
+         IMU_fixedError = fabs(d[i]);
+   }
+
+// Get (and reset) largest difference between fixed and float matrix elements seen since previous call.
+//
+PUBLIC FLOAT
+IMU_getFixedError()
+   {
+   DI();
+   FLOAT e = IMU_fixedError;
+   IMU_fixedError = 0;
+   EI();
+   return e;
+   }
+#endif
+
+// Get gyro bias learned by drift corrector, in radians/sec.
+//
+PUBLIC void
+IMU_getBias(FLOAT *roll, FLOAT *pitch, FLOAT *yaw)
+   {
+   DI();
+   *roll  = IMU_rollBias;
+   *pitch = IMU_pitchBias;
+   *yaw   = IMU_yawBias;
+   EI();
+   }
+
+#if !HAVE_DMP && !HAVE_GRAVITY_VECTOR && !HAVE_QUATERNION
+// Get (and reset) largest orthogonality error of orientation matrix seen since previous call.
+//
+PUBLIC FLOAT
+IMU_getOrthoError()
+   {
+   DI();
+#if HAVE_FIXED_DCM
+   FLOAT e = FIXED_TO_FLOAT(IMU_orthoError);
+#else
+   FLOAT e = IMU_orthoError;
+#endif
+   IMU_orthoError = 0;
+   EI();
+   return e;
+   }
+#endif
+
+#if HAVE_MAGNETOMETER
+// Measure yaw drift against the magnetometer.
+// Called by interrupt.
+//
+// Taken:    place to put imu-calculated yaw angle minus compass-indicated yaw angle, in radians
+// Returned: 1 = error measured, 0 = no new magnetometer reading
+//
+// The magnetic field vector, measured in the gyro reference frame, is rotated into the ground reference frame by the orientation matrix.
+// This compensates for roll and pitch, leaving the vector's heading on the ground fixed, so any change in it is yaw drift in the matrix.
+//
+PRIVATE BOOL
+IMU_getHeadingError(FLOAT *error)
+   {
+   FLOAT mx, my, mz;
+   if (!MAG_getField(&mx, &my, &mz))
+      return 0;
+
+   FLOAT gx = IMU_R(xx) * mx + IMU_R(xy) * my + IMU_R(xz) * mz;
+   FLOAT gy = IMU_R(yx) * mx + IMU_R(yy) * my + IMU_R(yz) * mz;
+   FLOAT heading = FIXED_TO_FLOAT(CORDIC_atan2((SDWORD)(gy * 16), (SDWORD)(gx * 16))); // (digits, keeping 4 fraction bits)
+
+   if (!IMU_headingReferenced)
+      {
+      IMU_headingReference  = heading;
+      IMU_headingReferenced = 1;
+      return 0;
+      }
+
+   FLOAT e = heading - IMU_headingReference;
+   if      (e >  M_PI) e -= 2 * M_PI;
+   else if (e < -M_PI) e += 2 * M_PI;
+   *error = e;
+   return 1;
+   }
+#endif
+
+#if HAVE_CONING
+// Combine successive gyro rotations into a single rotation vector.
+// Called by interrupt.
+//
+// Taken:    rotation measured over the latest sample, in radians
+// Updated:  (when interval is complete) rotation vector for the whole interval, in radians
+// Returned: 1 = interval of HAVE_CONING samples is complete, 0 = still accumulating
+//
+// Simply adding the samples would ignore the order in which they happened, which matters whenever the rotation axis is itself
+// moving ("coning": for example rolling while yawing through a turn). The sum is corrected with the recursive form of the
+// two-sample coning algorithm [Art 5]:
+//    beta  += (alpha + previous / 6) x sample / 2
+//    alpha += sample
+// where alpha is the sum of the samples so far, and previous is the sample before this one. The rotation vector is alpha + beta.
+//
+PRIVATE BOOL
+IMU_accumulate(FLOAT *dx, FLOAT *dy, FLOAT *dz)
+   {
+   static FLOAT ax, ay, az; // alpha
+   static FLOAT bx, by, bz; // beta
+   static FLOAT px, py, pz; // previous
+   static BYTE  n;
+
+   FLOAT cx = ax + px * (1.0 / 6), cy = ay + py * (1.0 / 6), cz = az + pz * (1.0 / 6);
+
+   bx += .5 * (cy * *dz - cz * *dy);
+   by += .5 * (cz * *dx - cx * *dz);
+   bz += .5 * (cx * *dy - cy * *dx);
+
+   ax += *dx; ay += *dy; az += *dz;
+   px  = *dx; py  = *dy; pz  = *dz;
+
+   if (++n < HAVE_CONING)
+      return 0;
+
+   *dx = ax + bx; *dy = ay + by; *dz = az + bz;
+   ax = ay = az = bx = by = bz = 0;
+   n  = 0;
+   return 1;
+   }
+#endif
+
+// Update orientation matrix in step with gyro's motions and apply drift corrections.
+// Called by interrupt, in the ticker's bottom half, once per queued timestep (IMU_HZ on average; orientation is updated at IMU_UPDATE_HZ).
+// Returned: 1 = a timestep was processed (call again for the next), 0 = none queued
+//
+PRIVATE BOOL
+IMU_update()
+   {
    // 1. Estimate how much the gyro has rotated during this timestep.
    // Note that these rotations are with respect to the gyro reference frame, not the ground.
+   // (They're collected even before alignment, so they don't pile up meanwhile.)
    //
    FLOAT rollDelta, pitchDelta, yawDelta;
-   GYRO_getRotations(&rollDelta, &pitchDelta, &yawDelta);
+   if (!GYRO_getRotations(&rollDelta, &pitchDelta, &yawDelta))
+      return 0;
+
+   if (!IMU_aligned)
+      return 1;
+
+#if HAVE_CONING
+   if (!IMU_accumulate(&rollDelta, &pitchDelta, &yawDelta))
+      return 1;
+#endif
 
    // 2. Estimate a correction that will counteract any errors that have accumulated in the orientation matrix...
    //
@@ -278,7 +975,7 @@ IMU_update()
    static FLOAT duration;
    if (upright)
       {
-      duration += 1.0 / IMU_HZ;
+      duration += 1.0 / IMU_UPDATE_HZ;
       if (duration < IMU_RATE_DURATION) 
          upright = 0; // rate hasn't persisted long enough yet
       }
@@ -298,9 +995,15 @@ IMU_update()
       // Caveats: cross-axis effects will be introduced if current pitch angle != original pitch angle (for example bike is now on a hill)
       // or if current roll angle (ie. zero) != original roll angle (for example bike was originally on its sidestand).
 
-      IMU_rollError  =  Rzy - IMU_rollReference;  // imu-calculated roll  angle should match initial reference, any difference is an error
-      IMU_pitchError = -Rzx - IMU_pitchReference; // imu-calculated pitch angle should match initial reference, any difference is an error
+      IMU_rollError  =  IMU_R(zy) - IMU_rollReference;  // imu-calculated roll  angle should match initial reference, any difference is an error
+      IMU_pitchError = -IMU_R(zx) - IMU_pitchReference; // imu-calculated pitch angle should match initial reference, any difference is an error
+#if HAVE_MAGNETOMETER
+      FLOAT yawError;
+      if (IMU_getHeadingError(&yawError))
+         IMU_yawError = yawError;  // imu-calculated yaw angle should hold compass heading, any difference is an error
+#else
       IMU_yawError   =  0; // we have no compass, thus nothing to compare with imu-calculated yaw angle, so assume no error
+#endif
       }
 
 #if 0  // 1 = road testing, 0 = normal field use
@@ -312,7 +1015,7 @@ IMU_update()
    // Apply error correction at rate specified by desired time constant.
    //
    const FLOAT T = IMU_TIME_CONSTANT; // time constant, in seconds
-   const FLOAT C = IMU_HZ;            // number of corrections to apply per second
+   const FLOAT C = IMU_UPDATE_HZ;     // number of corrections to apply per second
    const FLOAT K = 1.0 / T / C;       // fraction to apply per correction
 
    FLOAT rollCorr  = - K * IMU_rollError;
@@ -324,6 +1027,33 @@ IMU_update()
    IMU_rollError  += rollCorr;
    IMU_pitchError += pitchCorr;
    IMU_yawError   += yawCorr;
+
+   // Errors that keep coming back with the same sign are the work of a gyro bias, which we'd otherwise correct over and over.
+   // So also integrate the errors, into a bias estimate that's subtracted from the gyro rotations, making the corrector
+   // proportional-integral rather than merely proportional. With a bias b left uncorrected, each snapshot finds an error e of b times the
+   // time since the previous one. While it's worked off, the remaining errors add up to e / K, so integrating them with gain K / TI
+   // moves the estimate by e / TI, ie. towards b with time constant TI.
+   //
+   if (IMU_apply_dc)
+      {
+      const FLOAT TI = IMU_BIAS_CONSTANT; // time constant, in seconds
+      const FLOAT KI = K / TI;            // fraction of error to integrate per correction, in 1/seconds
+
+      IMU_rollBias  += KI * IMU_rollError;
+      IMU_pitchBias += KI * IMU_pitchError;
+      IMU_yawBias   += KI * IMU_yawError;
+
+      if (IMU_rollBias  >  IMU_BIAS_LIMIT) IMU_rollBias  =  IMU_BIAS_LIMIT;
+      if (IMU_rollBias  < -IMU_BIAS_LIMIT) IMU_rollBias  = -IMU_BIAS_LIMIT;
+      if (IMU_pitchBias >  IMU_BIAS_LIMIT) IMU_pitchBias =  IMU_BIAS_LIMIT;
+      if (IMU_pitchBias < -IMU_BIAS_LIMIT) IMU_pitchBias = -IMU_BIAS_LIMIT;
+      if (IMU_yawBias   >  IMU_BIAS_LIMIT) IMU_yawBias   =  IMU_BIAS_LIMIT;
+      if (IMU_yawBias   < -IMU_BIAS_LIMIT) IMU_yawBias   = -IMU_BIAS_LIMIT;
+
+      rollCorr  -= IMU_rollBias  / C;
+      pitchCorr -= IMU_pitchBias / C;
+      yawCorr   -= IMU_yawBias   / C;
+      }
    
    // Caveat: The way we're implementing this scheme to "snapshot" an error and then spread out the correction over multiple timesteps is not quite
    // correct in all cases. In particular, if the bike enters a turn while we're still applying residual corrections (that were measured in a 
@@ -343,9 +1073,22 @@ IMU_update()
 
    // Apply gyro rotations and drift corrections to orientation matrix (small angles assumed).
    //
+#if HAVE_FIXED_DCM || HAVE_QUATERNION
+   IMU_rotateFixed(FLOAT_TO_FIXED(rollDelta + rollCorr), FLOAT_TO_FIXED(pitchDelta + pitchCorr), FLOAT_TO_FIXED(yawDelta + yawCorr));
+#endif
+#if HAVE_FIXED_DCM != 1 && !HAVE_QUATERNION
    IMU_rotate(rollDelta + rollCorr, pitchDelta + pitchCorr, yawDelta + yawCorr);
+#endif
+#if HAVE_FIXED_DCM == 2
+   IMU_compareFixed();
+#endif
+
+   IMU_publish();
+   return 1;
    }
 
+#endif
+
 // --------------------------------------------------------------------------------------------------------------------------------------------------
 // Side note - calculating rotation angles between two sets of orthonormal coordinate axes using small angle approximations.
 // --------------------------------------------------------------------------------------------------------------------------------------------------
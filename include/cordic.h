@@ -0,0 +1,140 @@
+// Trig functions by CORDIC (coordinate rotation digital computer), in fixed point.
+//
+// Each function is a short loop of shifts and adds, in place of libm's float atan2, asin, sin, cos, and sqrt.
+// Angles are in radians, in FIXED format. Results are good to about 0.001 degree, well within the servo's 0.1 degree resolution.
+//
+// Ref: [http://en.wikipedia.org/wiki/CORDIC]
+//
+#include <avr/pgmspace.h>
+
+#define CORDIC_STEPS 20
+
+// Rotation angles: atan(2^-i), for i = 0..CORDIC_STEPS-1.
+//
+static const FIXED CORDIC_angles[CORDIC_STEPS] PROGMEM =
+   {
+   421657428, 248918915, 131521918, 66762579, 33510843, 16771758, 8387925, 4194219, 2097141, 1048575,
+      524288,    262144,    131072,    65536,    32768,    16384,    8192,    4096,    2048,    1024
+   };
+
+#define CORDIC_K    326016437L  // 0.60725 = product of cos(atan(2^-i)), ie. inverse of the length gain of the rotations
+#define CORDIC_PI   1686629713L // pi
+#define CORDIC_PI_2  843314857L // pi/2
+
+// Vectoring mode: find a vector's angle and length.
+// Taken:    vector's coordinates (any scale, a zero vector is taken to have angle 0)
+//           place to put vector's length, in the same scale as its coordinates (or 0 if not wanted)
+// Returned: vector's angle from x axis (-pi..pi)
+//
+static FIXED
+CORDIC_polar(SDWORD x, SDWORD y, SDWORD *r)
+   {
+   // Scale vector to 2^27..2^28 for full precision, leaving headroom for the growth in length (< 1.41 * 1.65) as it's rotated.
+   //
+   DWORD m = (x < 0 ? -x : x) | (y < 0 ? -y : y);
+   SBYTE shift = 0;
+   if (m)
+      {
+      while (m >= (1L << 28)) { m >>= 1; --shift; }
+      while (m <  (1L << 27)) { m <<= 1; ++shift; }
+      }
+   if (shift < 0) { x >>= -shift; y >>= -shift; }
+   else           { x <<=  shift; y <<=  shift; }
+
+   // Rotate vector into right half plane (+/- 90 degrees).
+   //
+   FIXED a = 0;
+   if (x < 0)
+      {
+      SDWORD t = x;
+      if (y >= 0) { x =  y; y = -t; a =  CORDIC_PI_2; }
+      else        { x = -y; y =  t; a = -CORDIC_PI_2; }
+      }
+
+   // Rotate vector onto x axis by successively smaller angles, accumulating them.
+   //
+   for (BYTE i = 0; i < CORDIC_STEPS; ++i)
+      {
+      SDWORD dx = x >> i;
+      SDWORD dy = y >> i;
+      FIXED  da = pgm_read_dword(&CORDIC_angles[i]);
+      if (y > 0) { x += dy; y -= dx; a += da; }
+      else       { x -= dy; y += dx; a -= da; }
+      }
+
+   if (r)
+      {
+      x = FIXED_mul(x, CORDIC_K);
+      *r = shift < 0 ? x << -shift : shift > 0 ? (x + (1L << (shift - 1))) >> shift : x;
+      }
+
+   return a;
+   }
+
+#define CORDIC_atan2(Y, X) CORDIC_polar(X, Y, 0)
+
+// Integer square root.
+//
+static DWORD
+CORDIC_isqrt(DWORD v)
+   {
+   DWORD r = 0;
+   DWORD b = 1L << 30;
+   while (b > v)
+      b >>= 2;
+   while (b)
+      {
+      if (v >= r + b) { v -= r + b; r = (r >> 1) + b; }
+      else            {             r =  r >> 1;      }
+      b >>= 2;
+      }
+   return r;
+   }
+
+// Arcsine.
+// Taken:    sine (-1..1)
+// Returned: angle (-pi/2..pi/2)
+//
+static FIXED
+CORDIC_asin(FIXED s)
+   {
+   if (s >  FIXED_ONE) s =  FIXED_ONE;
+   if (s < -FIXED_ONE) s = -FIXED_ONE;
+
+   // cosine = sqrt(1 - s^2), to 15 bits
+   //
+   FIXED c = CORDIC_isqrt(FIXED_mul(FIXED_ONE - s, FIXED_ONE + s) << 1) << (FIXED_BITS - 15);
+
+   return CORDIC_atan2(s, c);
+   }
+
+#if !HAVE_DMP // (orientation from the dmp needs no sines or cosines)
+// Rotation mode: find sine and cosine of an angle.
+// Taken:   angle (-pi..pi)
+//          places to put its sine and cosine
+//
+static void
+CORDIC_sincos(FIXED a, FIXED *s, FIXED *c)
+   {
+   // Fold angle into -pi/2..pi/2 (a half turn merely negates the result).
+   //
+   BOOL negate = 0;
+   if      (a >  CORDIC_PI_2) { a -= CORDIC_PI; negate = 1; }
+   else if (a < -CORDIC_PI_2) { a += CORDIC_PI; negate = 1; }
+
+   // Rotate a unit vector (shortened in advance to offset its growth) from the x axis by successively smaller angles, until they add up to a.
+   //
+   SDWORD x = CORDIC_K, y = 0;
+   for (BYTE i = 0; i < CORDIC_STEPS; ++i)
+      {
+      SDWORD dx = x >> i;
+      SDWORD dy = y >> i;
+      FIXED  da = pgm_read_dword(&CORDIC_angles[i]);
+      if (a >= 0) { x -= dy; y += dx; a -= da; }
+      else        { x += dy; y -= dx; a += da; }
+      }
+
+   *c = negate ? -x : x;
+   *s = negate ? -y : y;
+   }
+#endif
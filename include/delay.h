@@ -5,31 +5,17 @@
 #error These loops must be compiled with "-Os" optimization flag.
 #endif
 
-#if CLOCK_MHZ == 16
 // Delay, in milliseconds.
+// One loop iteration is about 5 cycles, so 1600 per ms at 8MHz, 3200 at 16MHz, 4000 at 20MHz.
 //
 __attribute__((noinline)) void
 delay_ms(WORD ms)
    {
    WORD n;
    while (ms--)
-     for (n = 0; n < 3200; ++n)
+     for (n = 0; n < CLOCK_MHZ * 200; ++n)
          __asm__ volatile ("nop");
    }
-#endif
-
-#if CLOCK_MHZ == 8
-// Delay, in milliseconds.
-//
-__attribute__((noinline)) void
-delay_ms(WORD ms)
-   {
-   WORD n;
-   while (ms--)
-     for (n = 0; n < 1600; ++n)
-       __asm__ volatile ("nop");
-   }
-#endif
 
 #if CLOCK_MHZ == 8
 // Delay, in microseconds.
@@ -0,0 +1,44 @@
+// Fixed point arithmetic.
+//
+// Numbers are held in Q2.29 format: a sign bit, 2 integer bits, and 29 fraction bits, giving a range of +/-4 and a resolution of 1.9e-9.
+// That's ample for the elements of a rotation matrix (magnitude <= 1) and for the differential rotations applied to it (a few milliradians).
+//
+// Products are assembled from four 16x16->32 bit multiplies, which avr-gcc carries out with the hardware 8x8 multiplier,
+// instead of the much longer software sequences needed for a float multiply and its following add.
+//
+
+typedef SDWORD FIXED;
+
+#define FIXED_BITS 29                  // fraction bits
+#define FIXED_ONE  (1L << FIXED_BITS)  // 1.0
+
+// Conversions (use sparingly at run time: these involve float arithmetic).
+//
+#define FLOAT_TO_FIXED(X) ((FIXED)((X) * FIXED_ONE))
+#define FIXED_TO_FLOAT(X) ((X) * (1.0 / FIXED_ONE))
+
+// Multiply.
+// Taken:    multiplicand and multiplier, each less than 2 in magnitude
+// Returned: product
+//
+// Splitting each operand into a signed high half and an unsigned low half:
+//
+//    a * b = ah * bh * 2^32 + (ah * bl + al * bh) * 2^16 + al * bl
+//
+// Only the high half of the last term can reach the result (it's worth up to 8 bits there), so we keep that and drop the low half.
+// The sum is then rounded to nearest, rather than truncated, so the product's error stays within 2^-30 and has no bias
+// (a truncated product would always err toward -infinity, and the integrator would accumulate that as drift).
+//
+static FIXED
+FIXED_mul(FIXED a, FIXED b)
+   {
+   SWORD ah = a >> 16; WORD al = a;
+   SWORD bh = b >> 16; WORD bl = b;
+
+   SDWORD hh = (SDWORD)ah * bh;
+   SDWORD hl = (SDWORD)ah * bl;
+   SDWORD lh = (SDWORD)bh * al;
+   DWORD  ll = (DWORD)al * bl;
+
+   return (hh << (32 - FIXED_BITS)) + ((hl + lh + (SDWORD)(ll >> 16) + (1L << (FIXED_BITS - 17))) >> (FIXED_BITS - 16));
+   }
@@ -0,0 +1,143 @@
+// Talk to a device via SPI (serial peripheral interface), as bus master.
+//
+// Units:      SPI
+// Interrupts: none
+// Pins:       #SS  (PORTB2) - device select
+//             MOSI (PORTB3)
+//             MISO (PORTB4)
+//             SCK  (PORTB5)
+// Clock:      8/16/20Mhz
+//
+// Usage:      #include "clock.h" (for CLOCK_SPI_SLOW_SPR)
+//             #include "spi.h"
+//
+// Register addressing follows the common sensor convention:
+// the first byte of a transaction is the register number, with its top bit set for reads.
+//
+// To exercise device code without the device, specify:
+//    #define SPI_MODEL 1
+// and provide a software model of the device:
+//    static void SPI_model_select();         - called at start of each transaction
+//    static BYTE SPI_model_transfer(BYTE b); - called for each byte of transaction, returns byte "received"
+//
+
+// --------------------------------------------------------------------
+//                        Implementation.
+// --------------------------------------------------------------------
+
+#define SPI_READ 0x80 // to read a register, "or" its number with this value
+
+#if SPI_MODEL
+static void SPI_model_select();
+static BYTE SPI_model_transfer(BYTE b);
+#endif
+
+// Begin a transaction.
+//
+static void
+SPI_select()
+   {
+#if SPI_MODEL
+   SPI_model_select();
+#else
+   PORTB &= ~(1 << PB2); // drive #SS low
+#endif
+   }
+
+// End a transaction.
+//
+static void
+SPI_deselect()
+   {
+#if !SPI_MODEL
+   PORTB |=  (1 << PB2); // drive #SS high
+#endif
+   }
+
+// Exchange a byte with device.
+// Taken:    byte to send
+// Returned: byte received
+//
+static BYTE
+SPI_transfer(BYTE b)
+   {
+#if SPI_MODEL
+   return SPI_model_transfer(b);
+#else
+   SPDR = b;
+   while (!(SPSR & (1 << SPIF))) ;
+   return SPDR;
+#endif
+   }
+
+// --------------------------------------------------------------------
+//                          Interface.
+// --------------------------------------------------------------------
+
+// Prepare SPI for use.
+// Taken:    1 = fast clock (system clock / 4, ie. 4 MHz at 16 MHz)
+//           0 = slow clock (at most 1 MHz: system clock / 16, or / 64 above 16 MHz)
+// Returned: nothing
+//
+// We use SPI mode 3 (clock idles high, data sampled on rising edge), which suits most sensors.
+//
+void
+SPI_init(BOOL fast)
+   {
+   // #SS must be an output (held high while idle), otherwise a low level on it would knock us out of master mode
+   PORTB |= (1 << PB2);
+   DDRB  |= (1 << DDB2) | (1 << DDB3) | (1 << DDB5); // #SS, MOSI, SCK are outputs; MISO is input
+
+   SPCR = 0
+        | (1 << SPE)           // enable spi
+        | (1 << MSTR)          // master
+        | (1 << CPOL)          // mode 3
+        | (1 << CPHA)          // "
+        | (fast ? 0 : CLOCK_SPI_SLOW_SPR) // clock = system clock / 4, or slow clock
+        ;
+   SPSR = 0;                   // no clock doubling
+   }
+
+// Write one byte to a device register.
+// Taken:    7 bit register number
+//           8 bit value to be written
+// Returned: nothing
+//
+void
+SPI_write(BYTE register_number, BYTE value)
+   {
+   SPI_select();
+   SPI_transfer(register_number);
+   SPI_transfer(value);
+   SPI_deselect();
+   }
+
+// Read one byte from a device register.
+// Taken:    7 bit register number
+// Returned: value read
+//
+BYTE
+SPI_read(BYTE register_number)
+   {
+   SPI_select();
+   SPI_transfer(register_number | SPI_READ);
+   BYTE value = SPI_transfer(0);
+   SPI_deselect();
+   return value;
+   }
+
+// Read multiple bytes from consecutive device registers.
+// Taken:    7 bit register number
+//           number of bytes to read
+//           place to put them
+// Returned: nothing
+//
+void
+SPI_read_multi(BYTE register_number, BYTE n, BYTE *dst)
+   {
+   SPI_select();
+   SPI_transfer(register_number | SPI_READ);
+   while (n--)
+      *dst++ = SPI_transfer(0);
+   SPI_deselect();
+   }
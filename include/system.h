@@ -2,7 +2,7 @@
 // Units:      CLOCK, WATCHDOG
 // Interrupts: enabled
 // Pins:       none
-// Clock:      8/16Mhz
+// Clock:      8/16/20Mhz
 //
 static void
 SYSTEM_init()
@@ -1,16 +1,25 @@
 // Talk to devices via TWI (two-wire interface).
 //
 // Units:      TWI
-// Interrupts: none
+// Interrupts: TWI_vect (optional)
 // Pins:       SDA (PORTC4)
 //             SCL (PORTC5)
-// Clock:      8Mhz
+// Clock:      8/16/20Mhz
 //
-// Usage:      #define TWI_KHZ  50
-//        /or/ #define TWI_KHZ 100
-//        /or/ #define TWI_KHZ 200
+// Usage:      #define TWI_KHZ 200 (for example, up to 400)
+//             #include "clock.h" (for CLOCK_TWBR_KHZ)
 //             #include "twi.h"
 //
+// For interrupt driven transfers (see TWI_submit) specify:
+//    #define TWI_USE_INTERRUPT 1
+//    #define TWI_SIZE 4 // transaction queue size (for example)
+//
+// Failed transfers are retried (after clearing the bus) before being reported to their owners:
+//    #define TWI_TRIES 3 // attempts per transfer (default 3)
+//
+// Errors are counted per operation type; TWI_show prints the counts and the clock rate in use,
+// which TWI_probe can raise to the fastest rate (up to 400 KHz) that the wiring supports.
+//
 // 16 Oct 2011 Derek Lieber
 //
 
@@ -18,13 +27,79 @@
 //                        Implementation.
 // --------------------------------------------------------------------
 
-#include <util/twi.h> // twi status codes - /usr/lib/avr/include/util/twi.h
+#include <util/twi.h>     // twi status codes - /usr/lib/avr/include/util/twi.h
+#include <avr/pgmspace.h> // PROGMEM, printf_P
 
 // TWI error notifier.
 //
 typedef void (*TWI_FUNC)();
 static TWI_FUNC TWI_notify;
 
+#ifndef TWI_TRIES
+#define TWI_TRIES 3
+#endif
+
+// Has an error been reported since this flag was last cleared?
+//
+static volatile BOOL TWI_failed;
+
+// Operation types, for error reporting.
+//
+#define TWI_OP_EXEC  0
+#define TWI_OP_START 1
+#define TWI_OP_SEND  2
+#define TWI_OP_RECV  3
+#define TWI_OP_ISR   4
+#define TWI_OP_WAIT  5
+#define TWI_OPS      6
+
+static const char TWI_op_names[TWI_OPS][6] PROGMEM = { "exec", "start", "send", "recv", "isr", "wait" }; // (in flash, to spare ram)
+
+// Bus health.
+//
+static volatile WORD TWI_errors[TWI_OPS]; // errors reported, by operation type
+static volatile WORD TWI_clears;          // bus clears performed
+static volatile WORD TWI_retries;         // transfers restarted after an error
+static          WORD TWI_khz;             // clock rate in use
+
+// Pause for half a bit time at 50 KHz, while clearing the bus.
+//
+static void
+TWI_pause()
+   {
+   for (BYTE n = 0; n < CLOCK_MHZ * 2; ++n)
+      __asm__ volatile ("nop");
+   }
+
+// Free the bus from a slave that has lost track of a transaction (typically a glitch on SCL, leaving it in mid-byte with SDA held low).
+// We take the pins away from the TWI unit and clock SCL by hand until the slave lets go of SDA, then send a stop condition.
+// See "bus clear", section 3.1.16 of the I2C-bus specification (NXP UM10204).
+//
+// This takes at most 11 SCL periods at 50 KHz, 220us, and is done from TWI_error, so possibly from the TWI interrupt.
+// That holds off the ticker for less than one tick (800us at 1250 Hz), so no tick is lost, and it's needed right there:
+// the retry that follows would fail on a held bus. It only happens when a slave really is holding SDA low (see TWI_reset),
+// and it stops as soon as the slave lets go.
+//
+static void
+TWI_clear()
+   {
+   TWCR  = 0;                              // disconnect TWI unit from pins
+   PORTC &= ~((1 << PC4) | (1 << PC5));    // lines are pulled low by making their pins outputs, released by making them inputs (external pullups)
+
+   for (BYTE i = 0; i < 9 && !(PINC & (1 << PINC4)); ++i)
+      {
+      DDRC |=  (1 << DDC5); TWI_pause();   // SCL low
+      DDRC &= ~(1 << DDC5); TWI_pause();   // SCL high
+      }
+
+   DDRC |=  (1 << DDC5); TWI_pause();      // SCL low
+   DDRC |=  (1 << DDC4); TWI_pause();      // SDA low
+   DDRC &= ~(1 << DDC5); TWI_pause();      // SCL high
+   DDRC &= ~(1 << DDC4); TWI_pause();      // SDA high (stop condition)
+
+   TWI_clears += 1;
+   }
+
 // Recover from a TWI bus error.
 // See section 21.7.5 and table 21-6 in databook.
 //
@@ -32,19 +107,25 @@ static void
 TWI_reset()
    {
    TWCR = ((1 << TWINT) | (1 << TWSTO));  // enter "not addressed" slave mode and release SDA/SCL lines
+   if (!(PINC & (1 << PINC4)))            // a slave is still holding SDA low
+      TWI_clear();
    }
 
 // Report a TWI error.
-// Taken:    operation type (exec, start, send, recv, stop)
+// Taken:    operation type (TWI_OP_XXX)
 // Returned: nothing
 // Side effect: after reporting error, we reset the bus and attempt to continue execution (with bad data)
 //
+// May be called by interrupt, so the error is only counted (for TWI_show), not printed: at 9600 baud
+// a message would hold off other interrupts for ~15 ms, per attempt.
+//
 static void 
-TWI_error(const char *op)
+TWI_error(BYTE op)
    {
-   if (!TWI_notify) printf("TWI error: %s\n", op);
-   else TWI_notify();
+   TWI_errors[op] += 1;
+   if (TWI_notify) TWI_notify();
    TWI_reset();
+   TWI_failed = 1;
    }
 
 // Execute a TWI operation.
@@ -62,7 +143,7 @@ TWI_exec(BYTE op)
    while (!(TWCR & (1 << TWINT)))
       if (++n == 300) // trial and error timeout value (depends on CLOCK_MHZ, TWI_KHZ, and device being addressed)
          {
-         TWI_error("exec");
+         TWI_error(TWI_OP_EXEC);
          break;
          }
    
@@ -70,14 +151,212 @@ TWI_exec(BYTE op)
    return TWSR & ~((1 << TWPS1) | (1 << TWPS0));
    }
 
+// A multi-byte register transfer.
+// The caller owns the descriptor and its data buffer, both of which must remain untouched until the transfer completes.
+//
+typedef struct TWI_XFER TWI_XFER;
+typedef void (*TWI_DONE)(TWI_XFER *xfer);
+
+struct TWI_XFER
+   {
+   BYTE          device_address;  // 7 bit device address
+   BYTE          register_number; // 7 bit register number (possibly or'ed with TWI_AUTO_INCREMENT)
+   BYTE          n;               // number of bytes to transfer (at least 1)
+   BYTE         *data;            // place to get/put them
+   BOOL          read;            // 1 = read from device, 0 = write to device
+   TWI_DONE      done;            // function to call when transfer completes (0=none)
+   volatile BOOL busy;            // transfer is queued or in progress
+   volatile BOOL error;           // transfer failed (data is garbage)
+   };
+
+#if TWI_USE_INTERRUPT
+
+// Transfers executed by interrupt, in the background.
+//
+
+#ifndef TWI_SIZE
+#error  TWI_SIZE
+#endif
+
+static TWI_XFER * volatile TWI_queue[TWI_SIZE];
+static volatile BYTE       TWI_head;  // queue slot of transfer in progress
+static volatile BYTE       TWI_count; // number of transfers queued, including the one in progress
+static volatile BYTE       TWI_index; // number of data bytes transferred so far
+static volatile BYTE       TWI_tries; // number of failed attempts at transfer in progress
+
+// TWCR command bits to continue a transfer and interrupt when the next step completes.
+//
+#define TWI_GO ((1 << TWINT) | (1 << TWEN) | (1 << TWIE))
+
+// Retire the transfer in progress and start the next one, if any.
+// A failed transfer is restarted instead, unless it has run out of tries.
+// Taken: did transfer fail?
+//
+static void
+TWI_finish(BOOL error)
+   {
+   TWI_XFER *xfer = TWI_queue[TWI_head];
+   
+   if (error)
+      {
+      TWI_error(TWI_OP_ISR);
+      if (++TWI_tries < TWI_TRIES)
+         {
+         TWI_retries += 1;
+         TWCR = TWI_GO | (1 << TWSTA);                          // begin transaction again (ST)
+         return;
+         }
+      }
+   TWI_tries = 0;
+
+   TWI_head   = (TWI_head + 1) % TWI_SIZE;
+   TWI_count -= 1;
+
+   if (TWI_count)
+      TWCR = TWI_GO | (error ? 0 : (1 << TWSTO)) | (1 << TWSTA); // end transaction (SP) then begin next one (ST)
+   else if (!error)
+      TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);          // end transaction (SP), no further interrupts
+
+   xfer->error = error;
+   xfer->busy  = 0;
+   if (xfer->done)
+      xfer->done(xfer);
+   }
+
+// Advance the transfer in progress by one bus operation.
+// Called by interrupt (or by TWI_wait, with interrupts disabled).
+//
+static void
+TWI_step()
+   {
+   TWI_XFER *xfer = TWI_queue[TWI_head];
+   
+   switch (TWSR & ~((1 << TWPS1) | (1 << TWPS0)))
+      {
+      case TW_START:          // send slave address (SLA+W)
+           TWDR = (xfer->device_address << 1) | TW_WRITE;
+           TWCR = TWI_GO;
+           break;
+
+      case TW_MT_SLA_ACK:     // send register number (SUB)
+           TWDR = xfer->register_number;
+           TWI_index = 0;
+           TWCR = TWI_GO;
+           break;
+
+      case TW_MT_DATA_ACK:
+           if (xfer->read)
+              TWCR = TWI_GO | (1 << TWSTA);        // begin transaction (SR)
+           else if (TWI_index < xfer->n)
+              {
+              TWDR = xfer->data[TWI_index++];      // send register value (DATA)
+              TWCR = TWI_GO;
+              }
+           else
+              TWI_finish(0);
+           break;
+
+      case TW_REP_START:      // send slave address (SLA+R)
+           TWDR = (xfer->device_address << 1) | TW_READ;
+           TWCR = TWI_GO;
+           break;
+
+      case TW_MR_SLA_ACK:     // receive register values (DATA), ack all bytes but last
+           TWI_index = 0;
+           TWCR = TWI_GO | (xfer->n > 1 ? (1 << TWEA) : 0);
+           break;
+
+      case TW_MR_DATA_ACK:
+           xfer->data[TWI_index++] = TWDR;
+           TWCR = TWI_GO | (TWI_index + 1 < xfer->n ? (1 << TWEA) : 0);
+           break;
+
+      case TW_MR_DATA_NACK:
+           xfer->data[TWI_index++] = TWDR;
+           TWI_finish(0);
+           break;
+
+      default:                // nack, arbitration lost, or bus error
+           TWI_finish(1);
+           break;
+      }
+   }
+
+// Discard all queued transfers, marking them as failed.
+// Assumption: interrupts are disabled
+//
+static void
+TWI_flush()
+   {
+   TWI_tries = 0;
+   while (TWI_count)
+      {
+      TWI_queue[TWI_head]->error = 1;
+      TWI_queue[TWI_head]->busy  = 0;
+      TWI_head   = (TWI_head + 1) % TWI_SIZE;
+      TWI_count -= 1;
+      }
+   }
+
+// "TWI" interrupt handler.
+//
+ISR(TWI_vect)
+   {
+   TWI_step();
+   }
+
+// Wait for all queued transfers to complete.
+// This works whether or not interrupts are enabled, so polled operations can safely follow it from any context.
+//
+static void
+TWI_wait()
+   {
+   WORD n = 0;
+   for (;;)
+      {
+      DI();
+      BYTE count = TWI_count;
+      if (count && (TWCR & (1 << TWINT)))
+         {
+         TWI_step();
+         n = 0;
+         }
+      EI();
+
+      if (!count)
+         break;
+
+      if (++n == 3000) // trial and error timeout value, 10x that of TWI_exec (a pending step may have to wait for an interrupt to finish)
+         {
+         TWI_error(TWI_OP_WAIT);
+         DI();
+         TWI_flush();
+         EI();
+         break;
+         }
+      }
+   }
+
+#else
+
+// Transfers executed by polling, in the foreground.
+//
+static void
+TWI_wait()
+   {
+   }
+
+#endif
+
 // Start a TWI transaction.
 //
 static void
 TWI_start()
    {
+   TWI_wait();
    BYTE status = TWI_exec((1 << TWINT) | (1 << TWEN) | (1 << TWSTA));
    if (status != TW_START && status != TW_REP_START)
-      TWI_error("start");
+      TWI_error(TWI_OP_START);
    }
 
 // Send a byte to TWI slave.
@@ -91,7 +370,7 @@ TWI_send(BYTE data, BYTE expected)
    TWDR = data;
    BYTE status = TWI_exec((1 << TWINT) | (1 << TWEN));
    if (status != expected)
-      TWI_error("send");
+      TWI_error(TWI_OP_SEND);
    }
 
 // Receive a byte from TWI slave.
@@ -105,13 +384,13 @@ TWI_recv(BOOL ack)
       {
       BYTE status = TWI_exec((1 << TWINT) | (1 << TWEN) | (1 << TWEA));
       if (status != TW_MR_DATA_ACK)
-         TWI_error("recv");
+         TWI_error(TWI_OP_RECV);
       }
    else
       {
       BYTE status = TWI_exec((1 << TWINT) | (1 << TWEN));
       if (status != TW_MR_DATA_NACK)
-         TWI_error("recv");
+         TWI_error(TWI_OP_RECV);
       }
    
    return TWDR;
@@ -130,6 +409,24 @@ TWI_stop()
 //                          Interface.
 // --------------------------------------------------------------------
 
+// Set TWI clock frequency.
+// Taken:    clock rate, in KHz (at most 400)
+// Returned: nothing
+//
+//    prescaler     = 1
+//    SCL frequency = CLOCK_HZ / (16 + 2 * TWBR * prescaler)
+//
+// eg. 8MHz, 200KHz => TWBR = 12; 16MHz, 400KHz => TWBR = 12; 20MHz, 400KHz => TWBR = 17
+//
+static void
+TWI_set_rate(WORD khz)
+   {
+   TWI_wait();
+   TWSR = (0 << TWPS1) | (0 << TWPS0); // prescaler = 1
+   TWBR = CLOCK_TWBR_KHZ(khz);         // divisor
+   TWI_khz = khz;
+   }
+
 // Prepare TWI for use.
 // Taken:    function to call for TWI error notifications (0=none)
 // Returned: nothing
@@ -138,90 +435,7 @@ static void
 TWI_init(TWI_FUNC notify)
    {
    TWI_notify = notify;
-   
-#if CLOCK_MHZ == 8
-   #if TWI_KHZ == 50
-      // set TWI clock frequency to 50 KHz
-      //
-      // CLOCK_HZ      = 8,000,000
-      // TWBR          = 72
-      // prescaler     = 1
-      // SCL frequency = CLOCK_HZ  / (16 + 2 * TWBR * prescaler)
-      //               = 8,000,000 / (16 + 2 *  72  * 1)
-      //               = 50 KHz
-
-      TWSR = (0 << TWPS1) | (0 << TWPS0); // prescaler = 1
-      TWBR = 72;                          // divisor
-
-   #elif TWI_KHZ == 100
-
-      // set TWI clock frequency to 100 KHz
-      //
-      // CLOCK_HZ      = 8,000,000
-      // TWBR          = 32
-      // prescaler     = 1
-      // SCL frequency = CLOCK_HZ  / (16 + 2 * TWBR * prescaler)
-      //               = 8,000,000 / (16 + 2 *  32  * 1)
-      //               = 100 KHz
-
-      TWSR = (0 << TWPS1) | (0 << TWPS0); // prescaler = 1
-      TWBR = 32;                          // divisor
-
-   #elif TWI_KHZ == 200
-
-      // set TWI clock frequency to 200 KHz
-      //
-      // CLOCK_HZ      = 8,000,000
-      // TWBR          = 12
-      // prescaler     = 1
-      // SCL frequency = CLOCK_HZ  / (16 + 2 * TWBR * prescaler)
-      //               = 8,000,000 / (16 + 2 *  12  * 1)
-      //               = 200 KHz
-
-      TWSR = (0 << TWPS1) | (0 << TWPS0); // prescaler = 1
-      TWBR = 32;                          // divisor
-
-   #else
-   #error TWI_KHZ
-   #endif
-
-#elif CLOCK_MHZ == 16
-   
-   #if TWI_KHZ == 100
-
-      // set TWI clock frequency to 100 KHz
-      //
-      // CLOCK_HZ      = 16,000,000
-      // TWBR          = 72
-      // prescaler     = 1
-      // SCL frequency = CLOCK_HZ   / (16 + 2 * TWBR * prescaler)
-      //               = 16,000,000 / (16 + 2 *  72  * 1)
-      //               = 100 KHz
-
-      TWSR = (0 << TWPS1) | (0 << TWPS0); // prescaler = 1
-      TWBR = 72;                          // divisor
-
-   #elif TWI_KHZ == 200
-
-      // set TWI clock frequency to 200 KHz
-      //
-      // CLOCK_HZ      = 16,000,000
-      // TWBR          = 32
-      // prescaler     = 1
-      // SCL frequency = CLOCK_HZ   / (16 + 2 * TWBR * prescaler)
-      //               = 16,000,000 / (16 + 2 *  32  * 1)
-      //               = 200 KHz
-
-      TWSR = (0 << TWPS1) | (0 << TWPS0); // prescaler = 1
-      TWBR = 32;                          // divisor
-
-   #else
-   #error TWI_KHZ
-   #endif
-
-#else
-#error CLOCK_MHZ
-#endif
+   TWI_set_rate(TWI_KHZ);
    }
    
 // Write one byte to a TWI device.
@@ -315,3 +529,185 @@ TWI_read_multi(BYTE device_address, BYTE register_number, BYTE n, BYTE *dst)
    // end transaction (SP)
    TWI_stop();
    }
+
+// Write multiple bytes to a TWI device.
+// Taken:    7 bit device address
+//           7 bit register number (possibly or'ed with TWI_AUTO_INCREMENT)
+//           number of bytes to write
+//           place to get them
+// Returned: nothing
+//
+void
+TWI_write_multi(BYTE device_address, BYTE register_number, BYTE n, BYTE *src)
+   {
+   // begin transaction (ST)
+   TWI_start();
+
+   // send slave address (SLA+W)
+   TWI_send((device_address << 1) | TW_WRITE, TW_MT_SLA_ACK);
+
+   // send register number (SUB) 
+   TWI_send(register_number, TW_MT_DATA_ACK);
+
+   // send register values (DATA)
+   while (n--)
+      TWI_send(*src++, TW_MT_DATA_ACK);
+
+   // end transaction (SP)
+   TWI_stop();
+   }
+
+// Submit a transfer.
+// Taken:    transfer descriptor
+// Returned: 1 = accepted, 0 = rejected (transfer still busy from a previous submission, or queue full)
+//
+// With TWI_USE_INTERRUPT the transfer is queued and carried out in the background, and its "done" function is called by interrupt.
+// Otherwise it's carried out immediately, by polling, and "done" is called before we return.
+// Once interrupt driven transfers are in use, polled operations (TWI_read, TWI_write, etc) must be issued with interrupts disabled.
+//
+BOOL
+TWI_submit(TWI_XFER *xfer)
+   {
+#if TWI_USE_INTERRUPT
+   DI();
+   if (xfer->busy || TWI_count == TWI_SIZE)
+      {
+      EI();
+      return 0;
+      }
+
+   xfer->busy  = 1;
+   xfer->error = 0;
+   TWI_queue[(TWI_head + TWI_count) % TWI_SIZE] = xfer;
+   if (TWI_count++ == 0)
+      {
+      // let previous stop condition, if any, complete
+      // (after TWI_reset the unit is disabled and TWSTO can stay set indefinitely, so only an enabled unit is waited for, and not forever)
+      //
+      WORD n = 0;
+      while ((TWCR & ((1 << TWEN) | (1 << TWSTO))) == ((1 << TWEN) | (1 << TWSTO)))
+         if (++n == 300) // same timeout as TWI_exec
+            {
+            TWI_error(TWI_OP_START);
+            break;
+            }
+      TWCR = TWI_GO | (1 << TWSTA);        // begin transaction (ST)
+      }
+   EI();
+#else
+   for (BYTE tries = 0;;)
+      {
+      TWI_failed = 0;
+      if (xfer->read) TWI_read_multi (xfer->device_address, xfer->register_number, xfer->n, xfer->data);
+      else            TWI_write_multi(xfer->device_address, xfer->register_number, xfer->n, xfer->data);
+      if (!TWI_failed || ++tries == TWI_TRIES)
+         break;
+      TWI_retries += 1;
+      }
+   xfer->error = TWI_failed;
+   if (xfer->done)
+      xfer->done(xfer);
+#endif
+   return 1;
+   }
+
+// Abandon all queued transfers (for example, after a device has hung the bus) and reset the bus.
+// Their "done" functions are not called.
+//
+void
+TWI_abort()
+   {
+   DI();
+#if TWI_USE_INTERRUPT
+   TWI_flush();
+#endif
+   TWI_reset();
+   EI();
+   }
+
+// Error notifier that ignores errors (they're still counted).
+//
+static void
+TWI_ignore()
+   {
+   }
+
+// Does a device answer reliably at a clock rate?
+// Its register must return the same value as a read at 100 KHz, 100 times in a row, without error.
+//
+static BOOL
+TWI_answers(BYTE device_address, BYTE register_number, WORD khz)
+   {
+   TWI_set_rate(100);
+   TWI_failed = 0;
+   BYTE expected = TWI_read(device_address, register_number);
+   if (TWI_failed)
+      return 0;
+
+   TWI_set_rate(khz);
+   for (BYTE n = 0; n < 100; ++n)
+      {
+      TWI_failed = 0;
+      if (TWI_read(device_address, register_number) != expected || TWI_failed)
+         return 0;
+      }
+   return 1;
+   }
+
+// Find the fastest clock rate at which all devices on the bus answer reliably, and switch to it.
+// Taken:    7 bit device addresses
+//           number of them
+//           7 bit register number of a register whose value never changes on any of them (eg. WHO_AM_I)
+// Returned: clock rate chosen, in KHz (TWI_KHZ if they don't all answer reliably at any rate)
+// Assumption: no interrupt driven transfers are in use yet
+//
+// Errors seen while probing are expected and are not kept in the error counts.
+//
+WORD
+TWI_probe(const BYTE *device_addresses, BYTE n, BYTE register_number)
+   {
+   static const WORD rates[] = { 400, 200, 100 }; // fastest first
+   TWI_FUNC notify = TWI_notify;
+   WORD     chosen = TWI_KHZ;
+
+   TWI_notify = TWI_ignore;
+   for (BYTE i = 0; i < sizeof(rates) / sizeof(rates[0]); ++i)
+      {
+      BYTE d;
+      for (d = 0; d < n; ++d)
+         if (!TWI_answers(device_addresses[d], register_number, rates[i]))
+            break;
+      if (d == n)
+         {
+         chosen = rates[i];
+         break;
+         }
+      }
+
+   TWI_set_rate(chosen);
+   TWI_notify = notify;
+   for (BYTE op = 0; op < TWI_OPS; ++op)
+      TWI_errors[op] = 0;
+   TWI_clears  = 0;
+   TWI_retries = 0;
+   return chosen;
+   }
+
+// Print bus health: clock rate, error counts by operation type, bus clears, and retries.
+//
+void
+TWI_show()
+   {
+   WORD errors[TWI_OPS], clears, retries;
+   DI();
+   for (BYTE op = 0; op < TWI_OPS; ++op)
+      errors[op] = TWI_errors[op];
+   clears  = TWI_clears;
+   retries = TWI_retries;
+   EI();
+
+   printf("twi=%uKHz", TWI_khz);
+   for (BYTE op = 0; op < TWI_OPS; ++op)
+      printf_P(PSTR(" %S=%u"), TWI_op_names[op], errors[op]);
+   printf(" clears=%u retries=%u\n", clears, retries);
+   }
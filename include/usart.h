@@ -2,7 +2,11 @@
 // Units:      USART0
 // Interrupts: USART_RX_vect (optional)
 // Pins:       PORTD0, PORTD1
-// Clock:      8/16Mhz
+// Clock:      8/16/20Mhz
+//
+// Usage:      #define USART_BAUD 9600 (for example)
+//             #include "clock.h" (for CLOCK_UBRR)
+//             #include "usart.h"
 //
 // For interrupt driven version specify:
 //    #define USART_USE_INTERRUPT 1
@@ -93,7 +97,7 @@ USART_get()
    }
 #endif
 
-// Initialize for 9600 baud, 8N1.
+// Initialize for USART_BAUD baud, 8N1.
 // Assumptions: power-on usart defaults in effect
 //
 static void
@@ -101,32 +105,15 @@ USART_init()
    {
    // power-on defaults are:
    // - asynchronous mode
-   // - 1M baud rate for 16MHz clock, undefined for 8MHz clock
+   // - 1M baud rate for 16MHz clock, undefined otherwise
    // - 8N1 frames (10 bits: 1 start, 8 data, 0 parity, 1 stop)
    //
 
-#if CLOCK_MHZ == 8
-
-   // set baud rate to 9600 using UBRR value
-   // from table 19-11 of atmega168 datasheet
-   // for FOSC=8Mhz, U2Xn=0
-   //
-   #define MYUBRR  51UL
-
-#elif CLOCK_MHZ == 16
-
-   // set baud rate to 9600 using UBRR value
-   // from table 19-12 of atmega168 datasheet
-   // for FOSC=16Mhz, U2Xn=0
+   // set baud rate to USART_BAUD using UBRR value from clock plan ("clock.h")
+   // eg. 9600 baud => UBRR = 51 at 8MHz, 103 at 16MHz, 129 at 20MHz (U2Xn=0)
    //
-   #define MYUBRR 103UL
-
-#else
-   #error CLOCK_MHZ
-#endif
-
-   UBRR0H = MYUBRR >> 8;
-   UBRR0L = MYUBRR;
+   UBRR0H = CLOCK_UBRR >> 8;
+   UBRR0L = CLOCK_UBRR;
    
    // configure PORTD0,PORTD1 for use as usart RXD,TXD
    UCSR0B |= (1 << RXEN0) | (1 << TXEN0);
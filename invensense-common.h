@@ -0,0 +1,67 @@
+// Readout decoding and scale factors common to the Invensense sensors: MPU6050 on twi ("invensense.h"),
+// MPU6000 or ICM-20602 on spi ("mpu6000.h"). They share a register layout and settings, so both drivers use these.
+//
+
+// Decode gyro sensor readout, mapping sensor axes to body axes such that:
+//    x points ahead (body roll axis)
+//    y points right (body pitch axis)
+//    z points down  (body yaw axis)
+//    signs follow right hand rule
+//
+PRIVATE void
+GYRO_decode_xyz(BYTE *b, SWORD *x, SWORD *y, SWORD *z)
+   {
+   *z = - ((b[0] << 8) | b[1]); // X sensor
+   *x = - ((b[2] << 8) | b[3]); // Y sensor
+   *y =   ((b[4] << 8) | b[5]); // Z sensor
+   }
+
+// Is the sensor an ICM-20602? Its temperature sensor has a different scale and offset than the MPU6050's and MPU6000's.
+// Set by MPU_init, from the sensor's WHO_AM_I register.
+//
+PRIVATE BOOL MPU_icm;
+
+// Decode temperature sensor readout.
+// Returned: temperature, in MPU6050 units whatever the part (see MPU_TEMP_DEGREES), so that temperature dependent
+//           data (the gyro bias model, for example) means the same thing on all of them
+//
+PRIVATE SWORD
+GYRO_decode_temp(BYTE *b)
+   {
+   SWORD t = (b[0] << 8) | b[1];
+   if (MPU_icm)
+      t = (((SDWORD)t * 1065) >> 10) - 3920; // (t / 326.8 + 25 - 36.53) * 340, good to 0.1C over the part's -40..85C range
+   return t;
+   }
+
+// Decode accelerometer sensor readout, mapping sensor axes to body axes such that:
+//    x points ahead (body roll axis)
+//    y points right (body pitch axis)
+//    z points down  (body yaw axis)
+//
+PRIVATE void
+ACCO_decode_xyz(BYTE *b, SWORD *x, SWORD *y, SWORD *z)
+   {
+   *z =   ((b[0] << 8) | b[1]); // X sensor
+   *x =   ((b[2] << 8) | b[3]); // Y sensor
+   *y = - ((b[4] << 8) | b[5]); // Z sensor
+   }
+
+// Sensor scale factors.
+//
+// MPU_GYRO_CONFIG | Full scale gyro sensitivity
+// ----------------+----------------------------
+//     0x00        |     +/- 250 deg/sec
+//     0x08        |     +/- 500 deg/sec
+//     0x10        |     +/-1000 deg/sec
+//     0x18        |     +/-2000 deg/sec
+   
+#if HAVE_DMP
+#define MPU_GYRO_SCALE_FACTOR (DEG_TO_RAD(2 * 2000.0) / 65536.) // radians-per-second per digit (the dmp image expects 0x18)
+#else
+#define MPU_GYRO_SCALE_FACTOR (DEG_TO_RAD(2 * 250.0) / 65536.) // radians-per-second per digit
+#endif
+#define MPU_ACCO_SCALE_FACTOR (          (2 *   2.0) / 65536.) // gees per digit
+#define MPU_ONE_GEE                                    16384   // accelerometer reading corresponding to 1 gee acceleration
+
+#define MPU_TEMP_DEGREES(T) ((T) / 340. + 36.53)                // temperature reading (as decoded) to degrees C
@@ -5,7 +5,7 @@
 //
 //                gyros                     accelerometers
 //                -----                     --------------
-// update rate:   200 Hz                    200 Hz
+// update rate:   200 Hz                    200 Hz      (1000 Hz with HAVE_FIFO)
 // bandwidth:     5 Hz                      5 Hz
 // range:         +/- 250 deg/sec           +/- 2 gee
 // sensitivity:   131 digits per deg/sec    16384 digits per gee
@@ -14,9 +14,28 @@
 // Implementation.
 // --------------------------------------------------------------------
 
-// TWI address.
+#if HAVE_FIFO + HAVE_DATA_READY + HAVE_DMP > 1
+#error  HAVE_FIFO, HAVE_DATA_READY, and HAVE_DMP are mutually exclusive
+#endif
+
+#if HAVE_DUAL_MPU && (HAVE_FIFO || HAVE_DMP)
+#error  HAVE_DUAL_MPU is not supported with HAVE_FIFO or HAVE_DMP
+#endif
+
+#if HAVE_MAGNETOMETER
+#error  HAVE_MAGNETOMETER is not supported for Invensense sensors
+#endif
+
+#if HAVE_TEMPCO && (HAVE_FIFO || HAVE_DMP)
+#error  HAVE_TEMPCO is not supported with HAVE_FIFO or HAVE_DMP
+#endif
+
+// TWI addresses.
 //
-#define MPU_ADDRESS 0x68
+#define MPU_ADDRESS   0x68 // first sensor  (AD0 pin low)
+#define MPU_ADDRESS_2 0x69 // second sensor (AD0 pin high), with HAVE_DUAL_MPU
+
+#define MPU_ADDRESS_OF(SENSOR) ((SENSOR) ? MPU_ADDRESS_2 : MPU_ADDRESS)
 
 // Registers.
 //
@@ -40,40 +59,216 @@
 #define MPU_GYRO_ZOUT_H      0x47
 #define MPU_GYRO_ZOUT_L      0x48
 
+#define MPU_FIFO_EN          0x23
+
+#define MPU_INT_PIN_CFG      0x37
+#define MPU_INT_ENABLE       0x38
+#define MPU_INT_STATUS       0x3A
+
+#define MPU_USER_CTRL        0x6A
 #define MPU_PWR_MGMT_1       0x6B
+#define MPU_BANK_SEL         0x6D
+#define MPU_MEM_START_ADDR   0x6E
+#define MPU_MEM_R_W          0x6F
+#define MPU_DMP_CFG_1        0x70
+#define MPU_DMP_CFG_2        0x71
+#define MPU_FIFO_COUNTH      0x72
+#define MPU_FIFO_COUNTL      0x73
+#define MPU_FIFO_R_W         0x74
 #define MPU_WHO_AM_I         0x75
 
-// Read gyro sensors, mapping sensor axes to body axes such that:
-//    x points ahead (body roll axis)
-//    y points right (body pitch axis)
-//    z points down  (body yaw axis)
-//    signs follow right hand rule
+// Gyro and accelerometer readouts, as TWI bursts.
+//
+#define GYRO_DEVICE(SENSOR) MPU_ADDRESS_OF(SENSOR)
+#define GYRO_REGISTER       (MPU_GYRO_XOUT_H | TWI_AUTO_INCREMENT)
+#define ACCO_DEVICE(SENSOR) MPU_ADDRESS_OF(SENSOR)
+#define ACCO_REGISTER       (MPU_ACCO_XOUT_H | TWI_AUTO_INCREMENT)
+
+// Temperature readout, as a TWI burst. The temperature register immediately precedes the gyro registers,
+// so a burst starting here delivers the temperature followed by a GYRO_REGISTER readout.
+//
+#define GYRO_TEMP_REGISTER  (MPU_TEMP_OUT_H | TWI_AUTO_INCREMENT)
+
+// Sensor transfers go via TWI.
+//
+#define MPU_submit TWI_submit
+#define MPU_abort  TWI_abort
+
+// Sensors and register read by TWI_probe to find the fastest clock rate the wiring supports.
+//
+#if HAVE_DUAL_MPU
+#define MPU_PROBE_DEVICES  { MPU_ADDRESS, MPU_ADDRESS_2 } // (the bus must run at a rate both sensors can take)
+#else
+#define MPU_PROBE_DEVICES  { MPU_ADDRESS }
+#endif
+#define MPU_PROBE_REGISTER MPU_WHO_AM_I
+
+// Write a sensor register (on all sensors).
 //
 PRIVATE void
-GYRO_read_xyz(SWORD *x, SWORD *y, SWORD *z)
+MPU_write(BYTE register_number, BYTE value)
    {
-   BYTE b[6];
-   TWI_read_multi(MPU_ADDRESS, MPU_GYRO_XOUT_H | TWI_AUTO_INCREMENT, sizeof(b), b);
+   for (BYTE sensor = 0; sensor < MPU_SENSORS; ++sensor)
+      TWI_write(MPU_ADDRESS_OF(sensor), register_number, value);
+   }
+
+#include "./invensense-common.h" // readout decoding, scale factors
 
-   *z = - ((b[0] << 8) | b[1]); // X sensor
-   *x = - ((b[2] << 8) | b[3]); // Y sensor
-   *y =   ((b[4] << 8) | b[5]); // Z sensor
+#if HAVE_DMP
+// Digital motion processor.
+//
+// The dmp program is InvenSense's "MotionApps" firmware, as distributed with their Motion Driver or the i2cdevlib MPU6050 driver.
+// Its license doesn't permit redistribution here, so it must be supplied separately, in "dmp-firmware.h", which must define:
+//    DMP_CODE[]        program image, in PROGMEM, to be loaded at bank 0 address 0
+//    DMP_CONFIG[]      configuration records, in PROGMEM, each consisting of: bank, address, length, data bytes
+//    DMP_START_ADDRESS program start address
+//    DMP_PACKET_SIZE   size of the packet the program writes to the fifo at its output rate (this code assumes the packet starts
+//                      with an orientation quaternion, as four 32 bit big endian fixed point numbers w, x, y, z with 1.0 == 2^30)
+//
+#include <avr/pgmspace.h>
+#include "./dmp-firmware.h"
+
+// Write a block of program memory to dmp, and read it back to verify.
+// Taken:    memory bank and address to be written
+//           place to get the data (in PROGMEM)
+//           number of bytes to write
+// Returned: 1 = verified, 0 = mismatch
+//
+PRIVATE BOOL
+DMP_write_memory(BYTE bank, BYTE address, const BYTE *src, WORD n)
+   {
+   BOOL ok = 1;
+   while (n)
+      {
+      // transfer in chunks, without crossing a bank boundary
+      //
+      BYTE chunk[16], check[16];
+      BYTE k = n < sizeof(chunk) ? n : sizeof(chunk);
+      if (address + k > 256)
+         k = 256 - address;
+
+      for (BYTE i = 0; i < k; ++i)
+         chunk[i] = pgm_read_byte(src + i);
+
+      TWI_write(MPU_ADDRESS, MPU_BANK_SEL,       bank);
+      TWI_write(MPU_ADDRESS, MPU_MEM_START_ADDR, address);
+      TWI_write_multi(MPU_ADDRESS, MPU_MEM_R_W, k, chunk);
+
+      TWI_write(MPU_ADDRESS, MPU_BANK_SEL,       bank);
+      TWI_write(MPU_ADDRESS, MPU_MEM_START_ADDR, address);
+      TWI_read_multi(MPU_ADDRESS, MPU_MEM_R_W, k, check);
+
+      for (BYTE i = 0; i < k; ++i)
+         if (chunk[i] != check[i])
+            ok = 0;
+
+      src     += k;
+      n       -= k;
+      address += k;
+      if (address == 0)
+         bank += 1;
+      }
+   return ok;
    }
 
-// Read accelerometer sensors, mapping sensor axes to body axes such that:
-//    x points ahead (body roll axis)
-//    y points right (body pitch axis)
-//    z points down  (body yaw axis)
+// Load and start the dmp program.
 //
 PRIVATE void
-ACCO_read_xyz(SWORD *x, SWORD *y, SWORD *z)
+DMP_init()
+   {
+   BOOL ok = DMP_write_memory(0, 0, DMP_CODE, sizeof(DMP_CODE));
+
+   for (const BYTE *p = DMP_CONFIG; p < DMP_CONFIG + sizeof(DMP_CONFIG); )
+      {
+      BYTE bank    = pgm_read_byte(p++);
+      BYTE address = pgm_read_byte(p++);
+      BYTE n       = pgm_read_byte(p++);
+      if (!DMP_write_memory(bank, address, p, n))
+         ok = 0;
+      p += n;
+      }
+
+   TWI_write(MPU_ADDRESS, MPU_DMP_CFG_1, DMP_START_ADDRESS >> 8);
+   TWI_write(MPU_ADDRESS, MPU_DMP_CFG_2, DMP_START_ADDRESS & 0xFF);
+   TWI_write(MPU_ADDRESS, MPU_USER_CTRL, 0xCC); // fifo enable + dmp enable + fifo reset + dmp reset
+
+   printf("dmp: %u bytes %s\n", (WORD)sizeof(DMP_CODE), ok ? "loaded" : "failed verification");
+   }
+
+// Decode the orientation quaternion at the start of a dmp packet.
+// Taken:    packet
+// Returned: quaternion, 1.0 == 16384 (upper halves of the dmp's 2^30 fixed point numbers)
+//
+PRIVATE void
+DMP_decode_quaternion(BYTE *b, SWORD *w, SWORD *x, SWORD *y, SWORD *z)
+   {
+   *w = (b[ 0] << 8) | b[ 1];
+   *x = (b[ 4] << 8) | b[ 5];
+   *y = (b[ 8] << 8) | b[ 9];
+   *z = (b[12] << 8) | b[13];
+   }
+
+#define MPU_FIFO_PACKET DMP_PACKET_SIZE // fifo holds dmp packets
+#define MPU_FIFO_RESET  0xC4            // fifo enable + dmp enable + fifo reset
+#elif HAVE_FIFO
+#define MPU_FIFO_PACKET 6               // fifo holds gyro samples
+#define MPU_FIFO_RESET  0x44            // fifo enable + fifo reset
+#endif
+
+#if HAVE_FIFO || HAVE_DMP
+// Gyro fifo readouts, as TWI bursts.
+// Without the dmp, the fifo holds gyro samples only, captured at the gyro output rate. Each is 6 bytes, laid out like a GYRO_REGISTER readout.
+// Note that the fifo data register doesn't auto-increment: successive reads pop successive bytes.
+//
+#define GYRO_FIFO_HZ              1000
+#define GYRO_FIFO_STATUS_REGISTER MPU_FIFO_COUNTH
+#define GYRO_FIFO_STATUS_SIZE     2
+#define GYRO_FIFO_REGISTER        MPU_FIFO_R_W
+
+PRIVATE BYTE     MPU_fifo_reset_data = MPU_FIFO_RESET;
+PRIVATE TWI_XFER MPU_fifo_reset_xfer = { MPU_ADDRESS, MPU_USER_CTRL, 1, &MPU_fifo_reset_data, 0, 0 };
+
+// Decode fifo status readout.
+// Returned: number of gyro samples (or dmp packets) waiting in fifo
+//
+PRIVATE WORD
+GYRO_decode_fifo_status(BYTE *b)
+   {
+   WORD count = (b[0] << 8) | b[1];
+
+   // A full (1024 byte) fifo discards its oldest data, leaving a partial sample at its head.
+   // Discard the rest and start afresh.
+   //
+   if (count % MPU_FIFO_PACKET || count > 1024 - MPU_FIFO_PACKET)
+      {
+      TWI_submit(&MPU_fifo_reset_xfer);
+      return 0;
+      }
+
+   return count / MPU_FIFO_PACKET;
+   }
+#endif
+
+// Read gyro sensors.
+// Taken: sensor number (0..MPU_SENSORS-1)
+//
+PRIVATE void
+GYRO_read_xyz(BYTE sensor, SWORD *x, SWORD *y, SWORD *z)
    {
    BYTE b[6];
-   TWI_read_multi(MPU_ADDRESS, MPU_ACCO_XOUT_H | TWI_AUTO_INCREMENT, sizeof(b), b);
+   TWI_read_multi(GYRO_DEVICE(sensor), GYRO_REGISTER, sizeof(b), b);
+   GYRO_decode_xyz(b, x, y, z);
+   }
 
-   *z =   ((b[0] << 8) | b[1]); // X sensor
-   *x =   ((b[2] << 8) | b[3]); // Y sensor
-   *y = - ((b[4] << 8) | b[5]); // Z sensor
+// Read accelerometer sensors.
+// Taken: sensor number (0..MPU_SENSORS-1)
+//
+PRIVATE void
+ACCO_read_xyz(BYTE sensor, SWORD *x, SWORD *y, SWORD *z)
+   {
+   BYTE b[6];
+   TWI_read_multi(ACCO_DEVICE(sensor), ACCO_REGISTER, sizeof(b), b);
+   ACCO_decode_xyz(b, x, y, z);
    }
 
 // --------------------------------------------------------------------
@@ -93,38 +288,56 @@ ACCO_read_xyz(SWORD *x, SWORD *y, SWORD *z)
 // 5          | 10Hz      | 13.8ms | 10Hz      | 13.4ms | 1 KHz
 // 6          | 5Hz       | 19.0ms | 5Hz       | 18.6ms | 1 KHz
 
-// Sensor scale factors.
+// Prepare one sensor for use.
+// Taken: its twi address
 //
-// MPU_GYRO_CONFIG | Full scale gyro sensitivity
-// ----------------+----------------------------
-//     0x00        |     +/- 250 deg/sec
-//     0x08        |     +/- 500 deg/sec
-//     0x10        |     +/-1000 deg/sec
-//     0x18        |     +/-2000 deg/sec
-   
-#define MPU_GYRO_SCALE_FACTOR (DEG_TO_RAD(2 * 250.0) / 65536.) // radians-per-second per digit
-#define MPU_ACCO_SCALE_FACTOR (          (2 *   2.0) / 65536.) // gees per digit
-#define MPU_ONE_GEE                                    16384   // accelerometer reading corresponding to 1 gee acceleration
-
-// Prepare gyros and accelerometers for use.
-//
-PUBLIC void
-MPU_init()
+PRIVATE void
+MPU_init_sensor(BYTE address)
    {
-   TWI_write(MPU_ADDRESS, MPU_PWR_MGMT_1, 0x80);  // device reset
+   TWI_write(address, MPU_PWR_MGMT_1, 0x80);      // device reset
    delay_ms(100);                                 // wait for reset to complete
-   TWI_write(MPU_ADDRESS, MPU_PWR_MGMT_1, 0x01);  // sleep = off, clock source = x gyro
+   TWI_write(address, MPU_PWR_MGMT_1, 0x01);      // sleep = off, clock source = x gyro
    delay_ms(5);                                   // wait for wakeup to complete
 
-   TWI_write(MPU_ADDRESS, MPU_CONFIG,       0x01); // filter b/w  = 188 Hz, gyro output rate = 1000Hz (power on default is 256 Hz, 8000Hz) [*]
-   TWI_write(MPU_ADDRESS, MPU_GYRO_CONFIG,  0x00); // gyro  scale = 250 deg/sec                       (power on default is 250 deg/sec)
-   TWI_write(MPU_ADDRESS, MPU_ACCO_CONFIG,  0x00); // accel scale = 2 gee                             (power on default is 2 gee)
-   TWI_write(MPU_ADDRESS, MPU_SMPLRT_DIV,   0x04); // sample rate = 200 Hz                            (power on default is 8000 Hz) [**]
+#if HAVE_DMP
+   TWI_write(address, MPU_CONFIG,       0x03);     // filter b/w  =  42 Hz, gyro output rate = 1000Hz (as the dmp image expects) [*]
+   TWI_write(address, MPU_GYRO_CONFIG,  0x18);     // gyro  scale = 2000 deg/sec                      (as the dmp image expects)
+#else
+   TWI_write(address, MPU_CONFIG,       0x01);     // filter b/w  = 188 Hz, gyro output rate = 1000Hz (power on default is 256 Hz, 8000Hz) [*]
+   TWI_write(address, MPU_GYRO_CONFIG,  0x00);     // gyro  scale = 250 deg/sec                       (power on default is 250 deg/sec)
+#endif
+   TWI_write(address, MPU_ACCO_CONFIG,  0x00);     // accel scale = 2 gee                             (power on default is 2 gee)
+#if HAVE_FIFO
+   TWI_write(address, MPU_SMPLRT_DIV,   0x00);     // sample rate = 1000 Hz                           (power on default is 8000 Hz) [**]
+   TWI_write(address, MPU_FIFO_EN,      0x70);     // fifo captures gyro x, y, z at sample rate
+   TWI_write(address, MPU_USER_CTRL,    0x44);     // fifo enable + fifo reset
+#elif HAVE_DATA_READY
+   #if 1000 % IMU_HZ
+   #error IMU_HZ must divide the 1000 Hz gyro output rate
+   #endif
+   TWI_write(address, MPU_SMPLRT_DIV,   1000 / IMU_HZ - 1);     // sample rate = IMU_HZ          (power on default is 8000 Hz) [**]
+   TWI_write(address, MPU_INT_PIN_CFG,  0x00);     // INT pin active high, push-pull, 50us pulse per sample
+   TWI_write(address, MPU_INT_ENABLE,   0x01);     // interrupt on "data ready"
+#elif HAVE_DMP
+   TWI_write(address, MPU_SMPLRT_DIV,   0x04);     // sample rate = 200 Hz, the dmp's input rate       (power on default is 8000 Hz) [**]
+   DMP_init();                                    // dmp output rate is set by DMP_CONFIG
+#else
+   TWI_write(address, MPU_SMPLRT_DIV,   0x04);     // sample rate = 200 Hz                            (power on default is 8000 Hz) [**]
+#endif
 
    // notes:
    // [*]  when filter is off (0)   the gyro output rate is 8000Hz
    //      when filter is on  (1-6) the gyro output rate is 1000Hz
    // [**] sample rate = gyro output rate / (1 + sample rate divider)
+   }
+
+// Prepare gyros and accelerometers for use.
+//
+PUBLIC void
+MPU_init()
+   {
+   for (BYTE sensor = 0; sensor < MPU_SENSORS; ++sensor)
+      MPU_init_sensor(MPU_ADDRESS_OF(sensor));
 
-   printf("%.1f digits per deg/sec\n", 1.0 / RAD_TO_DEG(MPU_GYRO_SCALE_FACTOR));
+   printf("%u sensor(s) %.1f digits per deg/sec\n", MPU_SENSORS, 1.0 / RAD_TO_DEG(MPU_GYRO_SCALE_FACTOR));
    }
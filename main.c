@@ -6,14 +6,16 @@
 // or   Contour Roam with gear driven lens barrel
 //
 // Microcontroller:
-//      Atmel ATMEGA328P running at 16 MHz
+//      Atmel ATMEGA328P running at 20 MHz
+//  or                              16 MHz
 //  or                               8 MHz
 //
 // Drive:
 //      Hitec HS-425BB servo
 //
 // Sensors:
-//      Invensense MPU6050
+//      Invensense MPU6050 (one, or two averaged)
+// or   Invensense MPU6000 or ICM-20602 (spi)
 // or   Pololu MinIMU-9 V2
 // or   Pololu L3GD20
 // or   Pololu L3G4200D
@@ -31,10 +33,10 @@
 //                                      
 // [ICP1][PCINT0][CLKO] PORTB0 = pin 14 <-  [pin] pushbutton
 // [OC1A][PCINT1]       PORTB1 = pin 15 ->  [pwm] servo
-// [OC1B][PCINT2] [#SS ]PORTB2 = pin 16 
-// [OC2A][PCINT3] [MOSI]PORTB3 = pin 17 
-//       [PCINT4] [MISO]PORTB4 = pin 18 
-//       [PCINT5] [SCK ]PORTB5 = pin 19 
+// [OC1B][PCINT2] [#SS ]PORTB2 = pin 16 ->  [spi]  imu #CS  (with HAVE_SPI_IMU)
+// [OC2A][PCINT3] [MOSI]PORTB3 = pin 17 ->  [spi]  imu SDI  (with HAVE_SPI_IMU)
+//       [PCINT4] [MISO]PORTB4 = pin 18 <-  [spi]  imu SDO  (with HAVE_SPI_IMU)
+//       [PCINT5] [SCK ]PORTB5 = pin 19 ->  [spi]  imu SCLK (with HAVE_SPI_IMU)
 //       [PCINT6][XTAL1]PORTB6 = pin  9 <-> [osc]
 //       [PCINT7][XTAL2]PORTB7 = pin 10 <-> [osc]
 //
@@ -49,7 +51,7 @@
 //
 //       [PCINT16] [RXD]PORTD0 = pin  2 <-  [usart] serial port
 //       [PCINT17] [TXD]PORTD1 = pin  3 ->  [usart] serial port
-//       [PCINT18][INT0]PORTD2 = pin  4
+//       [PCINT18][INT0]PORTD2 = pin  4 <-  [int0] mpu INT (data ready, with HAVE_DATA_READY)
 // [OC2B][PCINT19][INT1]PORTD3 = pin  5
 // [XCK] [PCINT20]  [T0]PORTD4 = pin  6
 // [OC0B][PCINT21]  [T1]PORTD5 = pin 11
@@ -58,7 +60,7 @@
 //
 // Fuse settings:
 //
-//  lfuse=d7 => external crystal    at 16MHz with brownout boot control
+//  lfuse=d7 => external crystal    at 16MHz with brownout boot control (or at 20MHz)
 //  lfuse=e6 => external resonator  at 16MHz with brownout boot control
 //  lfuse=c2 => internal oscillator at  8MHz with brownout boot control
 //  hfuse=dc => my bootloader, spi programming enabled
@@ -72,30 +74,92 @@
 #error  HAVE_POLOLU                   // 1 => Pololu L3G4200D
 #endif                                // 0 => Invensense MPU6050
 
+#ifndef HAVE_SPI_IMU                  // 2 => software model of spi sensor, for bench testing without one
+#define HAVE_SPI_IMU 0                // 1 => Invensense MPU6000 or ICM-20602 on spi bus (HAVE_POLOLU is then ignored)
+#endif                                // 0 => sensor on twi bus, per HAVE_POLOLU
+
+#ifndef HAVE_DUAL_MPU                 // 1 => second MPU6050 at twi address 0x69 (AD0 high), averaged with first
+#define HAVE_DUAL_MPU 0               // 0 => one sensor
+#endif
+
 #ifndef HAVE_ACCELEROMETERS           // 1 => MinIMU or MPU6050
 #error  HAVE_ACCELEROMETERS           // 0 => L3GD20
 #endif
 
-#ifndef HAVE_CLOCK                    // 16 => external oscillator at 16 MHz
-#error  HAVE_CLOCK                    //  8 => internal oscillator at 8 MHz
+#ifndef HAVE_MAGNETOMETER             // 1 => hold yaw to compass heading (MinIMU-9, ie. HAVE_POLOLU == 2 with HAVE_ACCELEROMETERS)
+#define HAVE_MAGNETOMETER 0           // 0 => no yaw reference
+#endif
+
+#ifndef HAVE_FIFO                     // 1 => drain all gyro samples from sensor fifo once per imu timestep (MPU6050 or Pololu gyros)
+#define HAVE_FIFO 0                   // 0 => read one gyro sample per imu timestep
+#endif
+
+#ifndef HAVE_DATA_READY               // 1 => run imu from MPU6050 "data ready" interrupt (INT0), at the sensor's sample rate
+#define HAVE_DATA_READY 0             // 0 => run imu from timer tick interrupt
+#endif
+
+#ifndef HAVE_DMP                      // 1 => track orientation with MPU6050 digital motion processor (needs "dmp-firmware.h", see "invensense.h")
+#define HAVE_DMP 0                    // 0 => track orientation with our own integrator
+#endif
+
+#ifndef HAVE_BIAS_TRACKING            // 1 => refine gyro biases whenever device is stationary, to follow their drift with temperature (not applicable with HAVE_DMP)
+#define HAVE_BIAS_TRACKING 0          // 0 => gyro biases only as set by calibration
+#endif                                // (stillness is judged from the gyros alone, so a slow steady turn can pass for it: see "mpu.h")
+
+#ifndef HAVE_TEMPCO                   // 1 => gyro biases follow sensor temperature, by a bias-versus-temperature model learned by HAVE_BIAS_TRACKING and kept in eeprom (Invensense sensors, without HAVE_FIFO or HAVE_DMP)
+#define HAVE_TEMPCO 0                 // 0 => gyro biases independent of temperature
+#endif
+
+#ifndef HAVE_FIXED_DCM                // 2 => as 1, also running float integrator alongside and reporting the difference (see watch_imu)
+#define HAVE_FIXED_DCM 0              // 1 => integrate orientation matrix in fixed point arithmetic (faster)
+#endif                                // 0 => integrate orientation matrix in floating point
+
+#ifndef HAVE_GRAVITY_VECTOR           // 1 => track only the direction of gravity (roll and pitch, yaw reads as zero), for faster integration
+#define HAVE_GRAVITY_VECTOR 0         // 0 => track full orientation
+#endif
+
+#ifndef HAVE_QUATERNION               // 1 => integrate orientation as a quaternion, in fixed point arithmetic (instead of a matrix)
+#define HAVE_QUATERNION 0             // 0 => integrate orientation matrix, per HAVE_FIXED_DCM and HAVE_GRAVITY_VECTOR
 #endif
 
+#ifndef HAVE_CONING                   // N => combine every N gyro samples into one orientation update, with coning compensation (N must divide IMU_HZ)
+#define HAVE_CONING 0                 // 0 => one orientation update per gyro sample
+#endif
+
+#ifndef HAVE_CLOCK                    // 20 => external oscillator at 20 MHz
+#error  HAVE_CLOCK                    // 16 => external oscillator at 16 MHz
+#endif                                //  8 => internal oscillator at 8 MHz
+
 // Clock rates.
 //
-#define CLOCK_MHZ      HAVE_CLOCK     // system clock rate (8 or 16 MHz)
-#define TWI_KHZ        200            // twi clock rate
-#define IMU_HZ         250            // imu update rate           (should be >= mpu sample rate)
-#if  CLOCK_MHZ == 8                   // timer tick interrupt rate (should be >= imu update rate, but see discussion in ticker.h)
-#define TICKER_HZ      500            // "
-#elif CLOCK_MHZ == 16                 // "
-#define TICKER_HZ     1000            // "
-#endif                                // "
+#define CLOCK_MHZ      HAVE_CLOCK     // system clock rate (8, 16, or 20 MHz)
+#define TWI_KHZ        200            // twi clock rate (up to 400)
+#define USART_BAUD    9600            // serial port baud rate
+#define SERVO_HZ        50            // servo pwm frame rate
+#define BATTERY_HZ      10            // battery monitor rate
+#define BUTTON_HZ       10            // pushbutton polling rate
+#define DISPLAY_HZ       4            // run() status display rate (a line takes ~0.1s to send at USART_BAUD)
+#define TEMPCO_HZ      100            // gyro bias model saving rate, in eeprom bytes per second (at most ~300, the eeprom's write rate)
+#define IMU_HZ         250            // imu update rate           (should be >= mpu sample rate, equals it with HAVE_DATA_READY)
+
+// The timer tick interrupt rate, TICKER_HZ, follows from CLOCK_MHZ [see "clock.h"].
+// It must be a multiple of IMU_HZ [see discussion in "ticker.h"].
+
+// Twi transfers.
+//
+#define TWI_USE_INTERRUPT 1           // sensor bursts run in the background, driven by TWI_vect [see "include/twi.h"]
+#define TWI_SIZE          4           // twi transfer queue size
+#define TWI_TRIES         3           // attempts per transfer, with a bus clear between them
+#define TWI_PROBE         1           // at startup, raise twi clock rate to the fastest (up to 400 KHz) at which the sensor reads cleanly
 
 // Includes.
 //
 #include <avr/io.h>                   // avr architecture - see /usr/lib/avr/include/avr/iomx8.h
 #include <avr/boot.h>                 // avr fuse and lock bits
 #include <avr/interrupt.h>            // avr interrupt helpers - ISR, sei, cli
+#include <avr/sleep.h>                // avr sleep modes - sleep_cpu
+
+#include "./clock.h"                  // timer and peripheral divisors for the clock rates above
 
 #include "./include/types.h"      // BOOL, BYTE, WORD, DWORD, FLOAT
 #include "./include/atomic.h"     // EI DI
@@ -107,10 +171,16 @@
 #include "./include/reboot.h"     // processor reboot
 #include "./include/bootloader.h" // LOADER_REQUEST_REBOOT
 #include "./include/twi.h"        // two-wire interface
+#if HAVE_SPI_IMU
+#define SPI_MODEL (HAVE_SPI_IMU == 2)
+#include "./include/spi.h"        // serial peripheral interface
+#endif
 #include "./include/eeprom.h"     // persistent memory
 #include "./include/stack.h"      // stack checker
+#include "./include/fixed.h"      // fixed point arithmetic
+#include "./include/cordic.h"     // trig functions
 
-#include <math.h>                                 // trig
+#include <math.h>                                 // fabs
 #define RAD_TO_DEG(X) ((X) * 57.2957795130823229) // radians to degrees
 #define DEG_TO_RAD(X) ((X) *  0.0174532925199433) // degrees to radians
 
@@ -128,6 +198,7 @@ typedef DWORD TICKS;                  // an interval measured by timer interrupt
 #include "./servo.h"                  // camera drive               [uses TIMER1 for pwm]
 #include "./ticker.h"                 // background task dispatcher [uses TIMER0 for timer tick interrupt generator]
 #include "./config.h"                 // board personality
+#include "./tasks.h"                  // main loop task scheduler
 
 // Calibrate battery monitor (set by comparing indicated reading to value measurd by external voltmeter).
 //
@@ -161,18 +232,19 @@ adjust_battery()
 void
 adjust_accelerometers()
    {
-   BYTE how = 0;
+   BYTE how    = 0;
+   BYTE sensor = 0;
    for (;;)
       {
       while (!USART_ready())
          {
          DI();
          SWORD x, y, z;
-         ACCO_read_xyz(&x, &y, &z);
+         ACCO_read_xyz(sensor, &x, &y, &z);
          EI();
-         x -= ACCO_x_bias;
-         y -= ACCO_y_bias;
-         z -= ACCO_z_bias;
+         x -= ACCO_x_bias[sensor];
+         y -= ACCO_y_bias[sensor];
+         z -= ACCO_z_bias[sensor];
          if      (how == 0) printf("\rx=%+6d y=%+6d z=%+6d ", x, y, z);
          else if (how == 1) printf("\rx=%+5.2f y=%+5.2f z=%+5.2f ", x * MPU_ACCO_SCALE_FACTOR, y * MPU_ACCO_SCALE_FACTOR, z * MPU_ACCO_SCALE_FACTOR);
          else               {
@@ -184,10 +256,11 @@ adjust_accelerometers()
       printf("\n");
       switch (USART_get())
          {
-         case 'v': how = (how + 1) % 3; break;
-         case '.': ACCO_calibrate();    break;
-         case 'q': goto done;           break;
-         default:  printf("?\n");       break;
+         case 'v': how = (how + 1) % 3;                 break;
+         case 's': sensor = (sensor + 1) % MPU_SENSORS; break; // (roll and pitch are always averaged over sensors)
+         case '.': ACCO_calibrate();                    break;
+         case 'q': goto done;                           break;
+         default:  printf("?\n");                       break;
          }
       }
    done:
@@ -199,26 +272,66 @@ adjust_accelerometers()
 void
 adjust_gyros()
    {
-   BYTE how = 0;
+   BYTE how    = 0;
+   BYTE sensor = 0;
    for (;;)
       {
       while (!USART_ready())
          {
          DI();
          SWORD x, y, z;
-         GYRO_read_xyz(&x, &y, &z);
+         GYRO_read_xyz(sensor, &x, &y, &z);
          EI();
-         x -= GYRO_x_bias;
-         y -= GYRO_y_bias;
-         z -= GYRO_z_bias;
+         x -= GYRO_x_bias[sensor];
+         y -= GYRO_y_bias[sensor];
+         z -= GYRO_z_bias[sensor];
          if (how == 0) printf("\rx=%+6d y=%+6d z=%+6d ", x, y, z);
          else          printf("\rx=%+6.2f y=%+6.2f z=%+6.2f ", RAD_TO_DEG(x * MPU_GYRO_SCALE_FACTOR), RAD_TO_DEG(y * MPU_GYRO_SCALE_FACTOR), RAD_TO_DEG(z * MPU_GYRO_SCALE_FACTOR));
+#if HAVE_BIAS_TRACKING && !HAVE_DMP
+         printf("bias=(%+d %+d %+d) ", GYRO_x_bias[sensor], GYRO_y_bias[sensor], GYRO_z_bias[sensor]);
+#endif
+#if HAVE_TEMPCO
+         printf("temp=%.1fC ", MPU_TEMP_DEGREES(GYRO_temp[sensor]));
+#endif
          }
       printf("\n");
       switch (USART_get())
          {
-         case 'v': how = (how + 1) % 2; break;
-         case '.': GYRO_calibrate();    break;
+         case 'v': how = (how + 1) % 2;                 break;
+         case 's': sensor = (sensor + 1) % MPU_SENSORS; break;
+         case '.': GYRO_calibrate();                    break;
+         case 'q': goto done;                           break;
+         default:  printf("?\n");                       break;
+         }
+      }
+   done:
+   printf("\n");
+   }
+
+#if HAVE_MAGNETOMETER
+// Calibrate magnetometer (assumption: device mounted on bike, for "."; bike level, for heading display).
+//
+void
+adjust_magnetometer()
+   {
+   for (;;)
+      {
+      while (!USART_ready())
+         {
+         DI();
+         SWORD x, y, z;
+         MAG_read_xyz(&x, &y, &z);
+         EI();
+         x -= MAG_x_bias;
+         y -= MAG_y_bias;
+         z -= MAG_z_bias;
+         printf("\rx=%+5d y=%+5d z=%+5d heading=%+6.1f ", x, y, z, RAD_TO_DEG(FIXED_TO_FLOAT(CORDIC_atan2((SDWORD)(-y * MAG_Y_GAIN), x))));
+         TIME_pause(1.0 / MAG_HZ);
+         }
+      printf("\n");
+      switch (USART_get())
+         {
+         case '.': MAG_calibrate();     break;
          case 'q': goto done;           break;
          default:  printf("?\n");       break;
          }
@@ -226,6 +339,7 @@ adjust_gyros()
    done:
    printf("\n");
    }
+#endif
 
 // See if motion integrator is generating proper angles.
 //
@@ -235,7 +349,31 @@ watch_imu()
    for (;;)
       {
       while (!USART_ready())
-         printf("\rdc=%u roll=%+5.1f pitch=%+5.1f yaw=%+5.1f ", IMU_apply_dc, RAD_TO_DEG(IMU_getRollAngle()), RAD_TO_DEG(IMU_getPitchAngle()), RAD_TO_DEG(IMU_getYawAngle()));
+         {
+         FLOAT roll, pitch, yaw;
+         IMU_getSnapshot(&roll, &pitch, &yaw);
+         printf("\rdc=%u roll=%+5.1f pitch=%+5.1f yaw=%+5.1f ", IMU_apply_dc, RAD_TO_DEG(roll), RAD_TO_DEG(pitch), RAD_TO_DEG(yaw));
+#if HAVE_FIXED_DCM == 2
+         printf("fixed-float=%.6f ", IMU_getFixedError());
+#endif
+#if !HAVE_DMP
+         FLOAT rb, pb, yb;
+         IMU_getBias(&rb, &pb, &yb);
+         printf("bias=(%+.3f %+.3f %+.3f) ", RAD_TO_DEG(rb), RAD_TO_DEG(pb), RAD_TO_DEG(yb));
+         printf("lost=%u ", GYRO_getLost());
+#endif
+         WORD overlaps, unread;
+         TICKER_getSkips(&overlaps, &unread);
+         printf("overlaps=%u unread=%u ", overlaps, unread);
+#if !HAVE_DMP && !HAVE_GRAVITY_VECTOR && !HAVE_QUATERNION
+         printf("ortho=%.6f ", IMU_getOrthoError());
+#endif
+#if !HAVE_DMP && !HAVE_FIFO
+         WORD late; FLOAT max_dt;
+         GYRO_getTiming(&late, &max_dt);
+         printf("late=%u dt=%.2fms ", late, max_dt * 1000);
+#endif
+         }
       printf("\n");
       switch (USART_get())
          {
@@ -248,111 +386,236 @@ watch_imu()
    printf("\n");
    }
 
-#if !HAVE_POLOLU
+#if !HAVE_POLOLU || HAVE_SPI_IMU
 void
 set_filter(BYTE filter)
    {
    printf("filter=%u\n", filter);
    DI();
-   TWI_write(MPU_ADDRESS, MPU_CONFIG, filter);
+   MPU_write(MPU_CONFIG, filter);
    EI();
    }
 #endif
  
+// Main loop state, shared by its tasks.
+//
+FLOAT  run_volts;          // battery voltage, as last read
+TICKS  run_start_critical; // when battery voltage dipped below critical level (0 = it hasn't)
+TICKS  run_start_blink;    // when "battery needs recharge" led was last toggled (0 = battery ok)
+BYTE   run_how;            // what to display
+
+// Monitor battery (blinking led means "battery needs charging").
+//
+void
+run_battery()
+   {
+   run_volts = BATTERY_read();
+
+   // if battery voltage is below critical level for more than 5 seconds, turn off the power
+   if (run_volts <= BATTERY_CRITICAL)
+      { // voltage dipped
+      if (!run_start_critical) run_start_critical = TIME_now();
+      if (TIME_elapsed(run_start_critical) > 5)
+         {
+         printf("power off!\n");
+         POWER_off();
+         }
+      }
+   else 
+      { // voltage recovered
+      run_start_critical = 0;
+      }
+         
+   // blink "battery needs recharge" warning
+   if (run_volts <= BATTERY_LOW)
+      { // voltage dipped
+      if (!run_start_blink) run_start_blink = TIME_now();
+      if (TIME_elapsed(run_start_blink) > .2)
+         {
+         LED_toggle();
+         run_start_blink = TIME_now();
+         }
+      }
+   else
+      { // voltage recovered
+      LED_on();
+      run_start_blink = 0;
+      }
+   }
+
+// Re-homing: use current camera orientation as "home" position.
+// Once begun, it waits for the button to be released, then a further 2 seconds (to let the hand get clear of the camera),
+// then aligns the camera and saves the alignment. It's stepped at BUTTON_HZ, so the main loop's other tasks keep running meanwhile.
+//
+#define REHOME_IDLE    0
+#define REHOME_RELEASE 1 // waiting for button to be released
+#define REHOME_SETTLE  2 // waiting before taking alignment
+
+BYTE   rehome_state;  // REHOME_IDLE, REHOME_RELEASE, or REHOME_SETTLE
+BYTE   rehome_ticks;  // BUTTON_HZ periods since button was released
+
+// Begin re-homing.
+//
+void
+rehome_begin()
+   {
+   LED_off(); // indicate button recognized
+   rehome_state = REHOME_RELEASE;
+   }
+
+// Advance re-homing by one BUTTON_HZ period.
+// Returned: 1 = re-homing in progress, 0 = idle (finished, or never begun)
+//
+BOOL
+rehome_step()
+   {
+   switch (rehome_state)
+      {
+      case REHOME_RELEASE:
+         if (BUTTON_pressed())
+            break;
+         rehome_ticks = 0;
+         rehome_state = REHOME_SETTLE;
+         break;
+
+      case REHOME_SETTLE:
+         if (++rehome_ticks < 2 * BUTTON_HZ)
+            break;
+         CAMERA_align();
+         CONFIG_save();
+         LED_on(); // indicate camera alignment completed
+         rehome_state = REHOME_IDLE;
+         break;
+      }
+   return rehome_state != REHOME_IDLE;
+   }
+
+// Button held at least 1 second means "use current camera orientation as 'home' position", as at startup.
+//
+void
+run_button()
+   {
+   static BYTE held; // consecutive polls that found button pressed
+
+   if (rehome_step())
+      return;
+
+   if (!BUTTON_pressed())
+      {
+      held = 0;
+      return;
+      }
+   if (++held < BUTTON_HZ)
+      return;
+   held = 0;
+
+   rehome_begin();
+   }
+
+#if HAVE_TEMPCO
+// Keep the gyro bias model in eeprom up to date, so that what's learned survives a power cycle.
+//
+void
+run_tempco()
+   {
+   if (GYRO_tempco_learned)
+      {
+      GYRO_tempco_learned = 0;
+      CONFIG_save_tempco();
+      }
+   CONFIG_flush();
+   }
+#endif
+
+void run_display();
+
+// Main loop tasks, in priority order.
+//
+TASK run_tasks[] =
+   {
+   { "battery", run_battery, TASK_TICKS(BATTERY_HZ), TASK_TICKS(BATTERY_HZ) },
+   { "button",  run_button,  TASK_TICKS(BUTTON_HZ),  TASK_TICKS(BUTTON_HZ)  },
+   { "display", run_display, TASK_TICKS(DISPLAY_HZ), TASK_TICKS(DISPLAY_HZ) },
+#if HAVE_TEMPCO
+   { "tempco",  run_tempco,  TASK_TICKS(TEMPCO_HZ),  TASK_TICKS(TEMPCO_HZ)  },
+#endif
+   };
+
+#define RUN_TASKS (sizeof(run_tasks) / sizeof(run_tasks[0]))
+
+// Display info.
+//
+void
+run_display()
+   {
+   FLOAT roll;
+   IMU_getSnapshot(&roll, 0, 0);
+
+   switch (run_how)
+      {
+      // nothing
+      case 0: break;
+      
+      // camera trims
+      case 1: printf("\rdc=%u roll=%+6.1f C=%+6.1f L=%+5.2f R=%+5.2f rev=%1u bat=%4.2fV (%c%c %2.0f,%2.0f)",
+                    IMU_apply_dc,
+                    RAD_TO_DEG(roll),
+                    RAD_TO_DEG(SERVO_center),
+                    SERVO_lgain,
+                    SERVO_rgain,
+                    SERVO_reverse,
+                    run_volts,
+                    run_volts <= BATTERY_LOW      ? 'L' : ' ',
+                    run_volts <= BATTERY_CRITICAL ? 'C' : ' ',
+                    run_start_blink               ? TIME_elapsed(run_start_blink)    : 0,
+                    run_start_critical            ? TIME_elapsed(run_start_critical) : 0
+                    );
+              break;
+      
+      // statistics
+      case 2: {
+              #define LIM (2 * 1000.0 * (1.0 / TICKER_HZ)) // ISR top half must complete within 2 timer tick intervals in order to avoid lost interrupts and inaccurate imu integration [see "ticker.h"]
+              printf("\rt=%-5.1f isr=%2u (%4.2fms/%4.2fms, %3.0fHz) imu=%2u (%4.2fms) cam=%2u (%4.2fms, %4.0fHz)",
+                    TIME_elapsed(0), 
+                    ISR_Duration,   COUNTER_counts_to_ms(ISR_Duration),   LIM, 1000. / COUNTER_counts_to_ms(ISR_Duration),
+                    IMU_Duration,   COUNTER_counts_to_ms(IMU_Duration),
+                    SERVO_Duration, COUNTER_counts_to_ms(SERVO_Duration),      1000. / COUNTER_counts_to_ms(SERVO_Duration)
+                    );
+              break;
+              }
+
+      // task lateness
+      case 3: printf("\r");
+              TASK_show(run_tasks, RUN_TASKS);
+              break;
+      }
+   }
+
 // Main loop: run motion compensation, monitor battery, adjust camera trims.
+// (The servo itself is driven by interrupt, once per pwm frame [see "servo.h"].)
 //
 void
 run()
    {
    LED_on();
-   
-   // battery monitor (blinking led means "battery needs charging")
-   TICKS start_critical = 0;
-   TICKS start_blink    = 0;
+   SERVO_start();
 
-   // debug
-   BYTE  how  = 0;
-   FLOAT roll = 0;
+   run_start_critical = 0;
+   run_start_blink    = 0;
+   run_how            = 0;
+   TASK_start(run_tasks, RUN_TASKS);
 
    for (;;)
       {
       while (!USART_ready())
          {
-         COUNTS start_cam = COUNTER_get();
-         
-         // track camera to horizon
-         roll = IMU_getRollAngle();
-         SERVO_setShaftAngle(roll);
-         
-         // if battery voltage is below critical level for more than 5 seconds, turn off the power
-         if (BATTERY_critical())
-            { // voltage dipped
-            if (!start_critical) start_critical = TIME_now();
-            if (TIME_elapsed(start_critical) > 5)
-               {
-               printf("power off!\n");
-               POWER_off();
-               }
-            }
-         else 
-            { // voltage recovered
-            start_critical = 0;
-            }
-               
-         // blink "battery needs recharge" warning
-         if (BATTERY_low())
-            { // voltage dipped
-            if (!start_blink) start_blink = TIME_now();
-            if (TIME_elapsed(start_blink) > .2)
-               {
-               LED_toggle();
-               start_blink = TIME_now();
-               }
-            }
-         else
-            { // voltage recovered
-            LED_on();
-            start_blink = 0;
-            }
-
-         COUNTS stop_cam = COUNTER_get();
-         
-         // display info
-         switch (how)
-            {
-            // nothing
-            case 0: break;
-            
-            // camera trims
-            case 1: printf("\rdc=%u roll=%+6.1f C=%+6.1f L=%+5.2f R=%+5.2f rev=%1u bat=%4.2fV (%c%c %2.0f,%2.0f)",
-                          IMU_apply_dc,
-                          RAD_TO_DEG(roll),
-                          RAD_TO_DEG(SERVO_center),
-                          SERVO_lgain,
-                          SERVO_rgain,
-                          SERVO_reverse,
-                          BATTERY_read(),
-                          BATTERY_low()      ? 'L' : ' ',
-                          BATTERY_critical() ? 'C' : ' ',
-                          start_blink        ? TIME_elapsed(start_blink)    : 0,
-                          start_critical     ? TIME_elapsed(start_critical) : 0
-                          );
-                    break;
-            
-            // statistics
-            case 2: {
-                    #define LIM (2 * 1000.0 * (1.0 / TICKER_HZ)) // ISR must complete within 2 timer tick intervals in order to avoid lost interrupts and inaccurate imu integration [see "ticker.h"]
-                    COUNTS cam_duration = stop_cam - start_cam;
-                    printf("\rt=%-5.1f isr=%2u (%4.2fms/%4.2fms, %3.0fHz) cam=%2u (%4.2fms, %4.0fHz)",
-                          TIME_elapsed(0), 
-                          ISR_Duration, COUNTER_counts_to_ms(ISR_Duration), LIM, 1000. / COUNTER_counts_to_ms(ISR_Duration),
-                          cam_duration, COUNTER_counts_to_ms(cam_duration),      1000. / COUNTER_counts_to_ms(cam_duration)
-                          );
-                    break;
-                    }
-            }
+         TASK_run(run_tasks, RUN_TASKS);
+         TASK_idle(run_tasks, RUN_TASKS);
          }
 
+      FLOAT roll;
+      IMU_getSnapshot(&roll, 0, 0);
+
       switch (USART_get())
          {
          // -------------
@@ -368,37 +631,46 @@ run()
          // If the camera is leaning right... the +/- keys adjust the right gain.
          // These adjustments must be made with the drift correction turned OFF (using "d" key).
          // Note: "+" turns the lens clockwise as viewed from rear of camera.
+         // Note: the servo interrupt reads the trims, so it's held off while they change.
          
          case '=':
-         case '+': if      (roll < DEG_TO_RAD(-10)) { if (SERVO_reverse) SERVO_lgain += .02; else SERVO_rgain += .02; }
+         case '+': SERVO_stop();
+                   if      (roll < DEG_TO_RAD(-10)) { if (SERVO_reverse) SERVO_lgain += .02; else SERVO_rgain += .02; }
                    else if (roll > DEG_TO_RAD(+10)) { if (SERVO_reverse) SERVO_rgain -= .02; else SERVO_lgain -= .02; }
-                   else                                                  SERVO_center -= DEG_TO_RAD(.5);
+                   else                                              SERVO_center -= DEG_TO_RAD(.5);
+                   SERVO_start();
                    break;
          
-         case '-': if      (roll < DEG_TO_RAD(-10)) { if (SERVO_reverse) SERVO_lgain -= .02; else SERVO_rgain -= .02; }
+         case '-': SERVO_stop();
+                   if      (roll < DEG_TO_RAD(-10)) { if (SERVO_reverse) SERVO_lgain -= .02; else SERVO_rgain -= .02; }
                    else if (roll > DEG_TO_RAD(+10)) { if (SERVO_reverse) SERVO_rgain += .02; else SERVO_lgain += .02; }
-                   else                                                  SERVO_center += DEG_TO_RAD(.5);
+                   else                                              SERVO_center += DEG_TO_RAD(.5);
+                   SERVO_start();
                    break;
 
-         case 'r': SERVO_reverse = !SERVO_reverse;
+         case 'r': SERVO_stop();
+                   SERVO_reverse = !SERVO_reverse;
+                   SERVO_start();
                    break;
 
-         case 'Z': SERVO_center  = 0;
+         case 'Z': SERVO_stop();
+                   SERVO_center  = 0;
                    SERVO_lgain   = 1;
                    SERVO_rgain   = 1;
                    SERVO_reverse = 0;
+                   SERVO_start();
                    break;
          
          // -----
          // debug
          // -----
          
-         case 'v': how = (how + 1) % 3; printf("\n"); break;
+         case 'v': run_how = (run_how + 1) % 4; printf("\n"); break;
          case 'd': IMU_apply_dc = !IMU_apply_dc;      break; // toggle drift correction
          case 'j': BATTERY_k -= .0001;                break; // test battery warning
          case 'k': BATTERY_k += .0001;                break; // "
          
-         #if !HAVE_POLOLU
+         #if !HAVE_POLOLU || HAVE_SPI_IMU
          case '1': set_filter(1); break;
          case '2': set_filter(2); break;
          case '3': set_filter(3); break;
@@ -412,6 +684,7 @@ run()
          }
       }
    done:
+   SERVO_stop();
    printf("\n");
    }
 
@@ -424,7 +697,7 @@ debug()
    
    for (;;)
       {
-      printf("%u I)nitialize b)attery a)cco g)yro i)imu r)un n)ormal d)ebug s)ave R)eboot >", STACK_free());
+      printf("%u I)nitialize b)attery a)cco g)yro %si)imu t)wi r)un n)ormal d)ebug s)ave R)eboot >", STACK_free(), HAVE_MAGNETOMETER ? "m)ag " : "");
       char ch = USART_get();
       printf("\n");
       switch (ch)
@@ -433,7 +706,11 @@ debug()
          case 'b': adjust_battery();                                  break; // adjust battery constant
          case 'a': adjust_accelerometers();                           break; // adjust accelerometer biases
          case 'g': adjust_gyros();                                    break; // adjust gyro biases
+         #if HAVE_MAGNETOMETER
+         case 'm': adjust_magnetometer();                             break; // adjust magnetometer biases
+         #endif
          case 'i': watch_imu();                                       break; // see if imu is operating properly
+         case 't': TWI_show();                                        break; // see if twi bus is healthy
          case 'r': run();                                             break; // run camera and adjust trims
          case 'n': CONFIG_Data.state =  CONFIG_READY; printf("ok\n"); break; // mark for normal startup on next boot
          case 'd': CONFIG_Data.state = !CONFIG_READY; printf("ok\n"); break; // mark for debug  startup on next boot
@@ -482,7 +759,14 @@ main(int argc, char **argv)
    BATTERY_init();
    POWER_init();
    TWI_init(0);
+#if TWI_PROBE && !HAVE_SPI_IMU
+   {
+   const BYTE devices[] = MPU_PROBE_DEVICES;
+   TWI_probe(devices, sizeof(devices), MPU_PROBE_REGISTER);
+   }
+#endif
    MPU_init();
+   TWI_show();   // (including any errors while initializing the sensors: they're counted, not printed as they happen)
    SERVO_init();
    CAMERA_init();
    BUTTON_init();
@@ -491,14 +775,9 @@ main(int argc, char **argv)
    // button held at least 1 second at startup means "use current camera orientation as 'home' position"
    if (BUTTON_held(1.0))
       {
-      LED_off(); // indicate button recognized
-
-      while (BUTTON_pressed()) ;
-      delay_ms(2000);
-      CAMERA_align();
-      CONFIG_save();
-
-      LED_on();  // indicate camera alignment completed
+      rehome_begin();
+      while (rehome_step())
+         TIME_pause(1. / BUTTON_HZ);
       }
       
    // if all configuration data is present and ready for use, run main loop
@@ -1,11 +1,30 @@
 // Controller for gyros and accelerometers.
 //
+// With HAVE_DUAL_MPU, two sensors share the bus. Each has its own biases and calibration data;
+// their bias corrected gyro readings are averaged before use, which lowers angle random walk without adding filter delay.
+//
 
 // --------------------------------------------------------------------
 // Implementation.
 // --------------------------------------------------------------------
 
-#if HAVE_POLOLU
+#define MPU_SENSORS (1 + HAVE_DUAL_MPU) // number of sensors
+
+#if HAVE_TEMPCO && !HAVE_BIAS_TRACKING
+#error  HAVE_TEMPCO needs HAVE_BIAS_TRACKING (which learns the bias model)
+#endif
+
+// Temperatures at which gyro biases are learned, with HAVE_TEMPCO, in decoded sensor units.
+// GYRO_decode_temp gives every part the MPU6050's scale (340 per degree C, 0 == 36.5 C), so these are -12, 12, 36, and 60 C. Beyond them, the end biases apply.
+//
+#define GYRO_TEMP_POINTS 4        // number of temperatures
+#define GYRO_TEMP_FIRST  (-16384) // lowest
+#define GYRO_TEMP_SHIFT  13       // log2 of spacing between them
+#define GYRO_TEMP_FILL   32        // adjustments after which a point counts as learned (leaving ~1% of its initial error, with GYRO_BIAS_K 3)
+
+#if HAVE_SPI_IMU
+#include "./mpu6000.h"
+#elif HAVE_POLOLU
 #include "./pololu.h"
 #else
 #include "./invensense.h"
@@ -14,67 +33,291 @@
 // --------------------------------------------------------------------
 // Interrupt communication area.
 //
-PRIVATE volatile SWORD  ACCO_x_bias;  // accelerometer zero-rate bias
-PRIVATE volatile SWORD  ACCO_y_bias;  // "
-PRIVATE volatile SWORD  ACCO_z_bias;  // "
+PRIVATE volatile SWORD  ACCO_x_bias[MPU_SENSORS]; // accelerometer zero-rate bias, per sensor
+PRIVATE volatile SWORD  ACCO_y_bias[MPU_SENSORS]; // "
+PRIVATE volatile SWORD  ACCO_z_bias[MPU_SENSORS]; // "
+
+PRIVATE volatile SWORD  GYRO_x_bias[MPU_SENSORS]; // gyro zero-rate bias, per sensor
+PRIVATE volatile SWORD  GYRO_y_bias[MPU_SENSORS]; // "
+PRIVATE volatile SWORD  GYRO_z_bias[MPU_SENSORS]; // "
+
+#if HAVE_TEMPCO
+PRIVATE volatile SWORD  GYRO_temp[MPU_SENSORS];                     // sensor temperature, as decoded
+PRIVATE volatile SDWORD GYRO_x_tempco[MPU_SENSORS][GYRO_TEMP_POINTS]; // gyro zero-rate bias at each of the GYRO_TEMP_POINTS temperatures, in 1/256 digits, per sensor
+PRIVATE volatile SDWORD GYRO_y_tempco[MPU_SENSORS][GYRO_TEMP_POINTS]; // "
+PRIVATE volatile SDWORD GYRO_z_tempco[MPU_SENSORS][GYRO_TEMP_POINTS]; // "
+PRIVATE          BYTE   GYRO_temp_fill[MPU_SENSORS][GYRO_TEMP_POINTS];  // adjustments made to each point since startup (up to GYRO_TEMP_FILL)
+PUBLIC  volatile BOOL   GYRO_tempco_learned;                            // a point has just been learned, so the model is worth saving
+#endif
 
-PRIVATE volatile SWORD  GYRO_x_bias;  // gyro zero-rate bias
-PRIVATE volatile SWORD  GYRO_y_bias;  // "
-PRIVATE volatile SWORD  GYRO_z_bias;  // "
+#if HAVE_DMP
+PRIVATE volatile SWORD  GYRO_qw;      // orientation computed by dmp, as unit quaternion (1.0 == 16384)
+PRIVATE volatile SWORD  GYRO_qx;      // "
+PRIVATE volatile SWORD  GYRO_qy;      // "
+PRIVATE volatile SWORD  GYRO_qz;      // "
+#else
+// Gyro rates, bias corrected, unsmoothed, queued for the integrator: one entry per timestep's readout
+// (with HAVE_FIFO, summed over the burst's samples; otherwise weighted by time since previous sample, in TIME_stamp counts).
+// There's a single producer (the readout's completion, at interrupt level) and a single consumer (IMU_update, in the ticker's bottom half).
+// Only the producer advances GYRO_head and only the consumer advances GYRO_tail, so neither has to lock the other out.
+//
+#define GYRO_RING 4 // entries (a power of 2)
+PRIVATE volatile struct { SDWORD x, y, z; } GYRO_ring[GYRO_RING];
+PRIVATE volatile BYTE   GYRO_head;    // entries queued  (since startup, modulo 256)
+PRIVATE volatile BYTE   GYRO_tail;    // entries consumed (")
+PRIVATE volatile WORD   GYRO_lost;    // number of readouts that found the ring full (folded into the newest entry, so integrated along with it rather than lost)
+#endif
 
-PRIVATE volatile SWORD  GYRO_x_urate; // gyro rate, bias corrected, unsmoothed
-PRIVATE volatile SWORD  GYRO_y_urate; // "
-PRIVATE volatile SWORD  GYRO_z_urate; // "
+#if !HAVE_DMP && !HAVE_FIFO
+PRIVATE volatile WORD   GYRO_late;    // number of samples taken more than 1.5 timesteps after their predecessor (ie. timesteps lost to overruns)
+PRIVATE volatile WORD   GYRO_max_dt;  // longest interval between samples, in TIME_stamp counts
+#endif
 
 PRIVATE volatile SWORD  GYRO_x_srate; // gyro rate, bias corrected, smoothed
 PRIVATE volatile SWORD  GYRO_y_srate; // "
 PRIVATE volatile SWORD  GYRO_z_srate; // "
 
+#if HAVE_MAGNETOMETER
+PRIVATE volatile SWORD  MAG_x;        // magnetometer reading, raw
+PRIVATE volatile SWORD  MAG_y;        // "
+PRIVATE volatile SWORD  MAG_z;        // "
+PRIVATE volatile BOOL   MAG_fresh;    // has it been updated since last MAG_getField?
+
+PRIVATE volatile SWORD  MAG_x_bias;   // magnetometer hard iron offset
+PRIVATE volatile SWORD  MAG_y_bias;   // "
+PRIVATE volatile SWORD  MAG_z_bias;   // "
+#endif
+
 PRIVATE volatile BOOL   MPU_calibrating;
-PRIVATE volatile SDWORD GYRO_x_sum;   // calibration data
-PRIVATE volatile SDWORD GYRO_y_sum;   // "
-PRIVATE volatile SDWORD GYRO_z_sum;   // "
-PRIVATE volatile SDWORD ACCO_x_sum;   // "
-PRIVATE volatile SDWORD ACCO_y_sum;   // "
-PRIVATE volatile SDWORD ACCO_z_sum;   // "
-PRIVATE volatile SWORD  MPU_cnt;      // "
+PRIVATE volatile SDWORD GYRO_x_sum[MPU_SENSORS]; // calibration data, per sensor
+PRIVATE volatile SDWORD GYRO_y_sum[MPU_SENSORS]; // "
+PRIVATE volatile SDWORD GYRO_z_sum[MPU_SENSORS]; // "
+PRIVATE volatile SDWORD ACCO_x_sum[MPU_SENSORS]; // "
+PRIVATE volatile SDWORD ACCO_y_sum[MPU_SENSORS]; // "
+PRIVATE volatile SDWORD ACCO_z_sum[MPU_SENSORS]; // "
+PRIVATE volatile SWORD  MPU_cnt;                 // "
 // --------------------------------------------------------------------
 
-// Update mpu data.
-// Called by interrupt.
+#if HAVE_DMP
+
+// Dmp packet readout, delivered by MPU_submit.
+//
+PRIVATE BYTE GYRO_fifo_status[GYRO_FIFO_STATUS_SIZE];
+PRIVATE BYTE GYRO_packet[DMP_PACKET_SIZE];
+
+// Process a dmp packet readout.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
 //
 PRIVATE void
-MPU_update()
+GYRO_packet_done(TWI_XFER *xfer)
    {
-   // accumulate data for zero rate bias calibration
+   // a failed transfer leaves the previous orientation in effect
    //
-   if (MPU_calibrating)
-      {
-      SWORD x, y, z;
-      GYRO_read_xyz(&x, &y, &z); GYRO_x_sum += x; GYRO_y_sum += y; GYRO_z_sum += z;
-      ACCO_read_xyz(&x, &y, &z); ACCO_x_sum += x; ACCO_y_sum += y; ACCO_z_sum += z;
-      MPU_cnt += 1;
+   if (xfer->error)
       return;
-      }
 
-   // raw sensor readings (MPU has fresh gyro data available at update rate of 1 KHz)
+   SWORD w, x, y, z;
+   DMP_decode_quaternion(xfer->data, &w, &x, &y, &z);
+
+   GYRO_qw = w;
+   GYRO_qx = x;
+   GYRO_qy = y;
+   GYRO_qz = z;
+   }
+
+PRIVATE TWI_XFER GYRO_packet_xfer = { GYRO_DEVICE(0), GYRO_FIFO_REGISTER, sizeof(GYRO_packet), GYRO_packet, 1, GYRO_packet_done };
+
+// Process a fifo status readout by reading the oldest packet it reports.
+// The dmp's output rate is below IMU_HZ, so one packet per timestep keeps up with it.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
+//
+PRIVATE void
+GYRO_status_done(TWI_XFER *xfer)
+   {
+   if (xfer->error || GYRO_packet_xfer.busy)
+      return;
+
+   if (GYRO_decode_fifo_status(xfer->data))
+      MPU_submit(&GYRO_packet_xfer);
+   }
+
+PRIVATE TWI_XFER GYRO_xfer[MPU_SENSORS] = { { GYRO_DEVICE(0), GYRO_FIFO_STATUS_REGISTER, sizeof(GYRO_fifo_status), GYRO_fifo_status, 1, GYRO_status_done } };
+
+#else
+
+#if HAVE_TEMPCO
+// Locate a temperature among the learning points.
+// Taken:    temperature, as decoded
+//           place to put its fractional distance from the point below it to the next one (0..255)
+// Returned: index of the point below it
+//
+PRIVATE BYTE
+GYRO_temp_point(SWORD t, BYTE *frac)
+   {
+   const SDWORD top = (SDWORD)(GYRO_TEMP_POINTS - 1) << GYRO_TEMP_SHIFT;
+
+   SDWORD u = (SDWORD)t - GYRO_TEMP_FIRST;
+   if (u < 0)    u = 0;
+   if (u >= top) u = top - 1;
+
+   *frac = u >> (GYRO_TEMP_SHIFT - 8);
+   return  u >>  GYRO_TEMP_SHIFT;
+   }
+
+// Interpolate one axis' bias between its learning points.
+// Returned: bias, in 1/256 digits
+//
+PRIVATE SDWORD
+GYRO_temp_bias(volatile SDWORD *tempco, BYTE i, BYTE frac)
+   {
+   return tempco[i] + (((tempco[i + 1] - tempco[i]) * frac) >> 8);
+   }
+
+// Set a sensor's biases for its current temperature.
+// Called by interrupt, with each temperature reading.
+//
+// That's three 32x8 bit multiplies per reading, whatever the temperature.
+//
+PRIVATE void
+GYRO_compensate(BYTE sensor)
+   {
+   BYTE frac, i = GYRO_temp_point(GYRO_temp[sensor], &frac);
+
+   GYRO_x_bias[sensor] = (GYRO_temp_bias(GYRO_x_tempco[sensor], i, frac) + 128) >> 8;
+   GYRO_y_bias[sensor] = (GYRO_temp_bias(GYRO_y_tempco[sensor], i, frac) + 128) >> 8;
+   GYRO_z_bias[sensor] = (GYRO_temp_bias(GYRO_z_tempco[sensor], i, frac) + 128) >> 8;
+   }
+#endif
+
+#if HAVE_BIAS_TRACKING
+// Stationary period detection, for zero rate bias tracking.
+//
+// Note that only the gyros are consulted. A smooth turn, steady enough and below GYRO_STILL_RATE, is indistinguishable from standing
+// still, and its rate would be taken for bias. Hence HAVE_BIAS_TRACKING is off by default.
+//
+#define GYRO_STILL_RATE    1.0 // largest rate (after bias removal) consistent with being stationary, in deg/sec
+#define GYRO_STILL_NOISE   0.3 // largest rms variation of rate consistent with being stationary, in deg/sec
+#define GYRO_STILL_SAMPLES 128 // samples per stationarity test
+#define GYRO_STILL_BLOCKS  4   // number of consecutive stationary tests needed before biases are adjusted
+#define GYRO_BIAS_K        3   // bias filter strength: each adjustment moves a bias 1/2^K of the way towards the measured one
+
+PRIVATE struct
+   {
+   SDWORD sum;   // rates (readings minus bias) summed over samples so far this test
+   DWORD  sumsq; // their squares, likewise
+#if !HAVE_TEMPCO
+   SDWORD fine;  // bias, in 1/256 digits, as filtered
+#endif
+   } GYRO_still[MPU_SENSORS][3];
+
+PRIVATE BYTE GYRO_still_n[MPU_SENSORS];      // samples so far this test
+PRIVATE BYTE GYRO_still_blocks[MPU_SENSORS]; // consecutive stationary tests passed (up to GYRO_STILL_BLOCKS)
+
+// Follow drift of zero rate biases (with temperature) while device is stationary, stopped at a light say.
+// Called by interrupt, with each raw gyro reading.
+//
+// Readings are taken in blocks, whose mean and variance (of rate after bias removal) are found for each axis.
+// A block in which no rate exceeds GYRO_STILL_RATE and no variance exceeds sensor noise passes as stationary.
+// Once several blocks in a row have passed, the mean of each further one is the bias error remaining, which is folded into the bias
+// by a slow low pass filter: a vibration or a slow turn that happens to slip through moves it only a little.
+//
+// With HAVE_TEMPCO the filter acts instead on the two learning points either side of the current temperature, each in proportion to
+// its nearness, so that over time the bias model learns the sensor's bias at each temperature it sees. The model is saved to eeprom
+// as each point is first learned (see GYRO_tempco_learned).
+//
+PRIVATE void
+GYRO_track(BYTE sensor, SWORD x, SWORD y, SWORD z)
+   {
+   const SWORD  rate_limit  = DEG_TO_RAD(GYRO_STILL_RATE) / MPU_GYRO_SCALE_FACTOR;
+   const SDWORD noise_limit = (DEG_TO_RAD(GYRO_STILL_NOISE) / MPU_GYRO_SCALE_FACTOR) * (DEG_TO_RAD(GYRO_STILL_NOISE) / MPU_GYRO_SCALE_FACTOR);
+
+   SWORD rate[3] = { x - GYRO_x_bias[sensor], y - GYRO_y_bias[sensor], z - GYRO_z_bias[sensor] };
+
+   // any motion fails the test and starts a new one
    //
-   SWORD x, y, z;
-   GYRO_read_xyz(&x, &y, &z);
+   for (BYTE i = 0; i < 3; ++i)
+      if (rate[i] > rate_limit || rate[i] < -rate_limit)
+         {
+         GYRO_still_n[sensor]      = 0;
+         GYRO_still_blocks[sensor] = 0;
+         return;
+         }
+
+   if (GYRO_still_n[sensor] == 0)
+      for (BYTE i = 0; i < 3; ++i)
+         GYRO_still[sensor][i].sum = GYRO_still[sensor][i].sumsq = 0;
+
+   for (BYTE i = 0; i < 3; ++i)
+      {
+      GYRO_still[sensor][i].sum   += rate[i];
+      GYRO_still[sensor][i].sumsq += (SDWORD)rate[i] * rate[i];
+      }
 
-   // remove zero rate biases
+   if (++GYRO_still_n[sensor] < GYRO_STILL_SAMPLES)
+      return;
+   GYRO_still_n[sensor] = 0;
+
+   // variance = mean of squares - square of mean
    //
-   x -= GYRO_x_bias;
-   y -= GYRO_y_bias;
-   z -= GYRO_z_bias;
+   for (BYTE i = 0; i < 3; ++i)
+      {
+      SDWORD mean = GYRO_still[sensor][i].sum / GYRO_STILL_SAMPLES;
+      if ((SDWORD)(GYRO_still[sensor][i].sumsq / GYRO_STILL_SAMPLES) - mean * mean > noise_limit)
+         {
+         GYRO_still_blocks[sensor] = 0;
+         return;
+         }
+      }
+
+   if (GYRO_still_blocks[sensor] < GYRO_STILL_BLOCKS)
+      {
+      GYRO_still_blocks[sensor] += 1;
+      return;
+      }
 
-   // unsmoothed rates, for integrator
+#if HAVE_TEMPCO
+   volatile SDWORD *tempco[3] = { GYRO_x_tempco[sensor], GYRO_y_tempco[sensor], GYRO_z_tempco[sensor] };
+   BYTE frac, j = GYRO_temp_point(GYRO_temp[sensor], &frac);
+
+   for (BYTE i = 0; i < 3; ++i)
+      {
+      SDWORD error = (GYRO_still[sensor][i].sum << 8) / GYRO_STILL_SAMPLES;
+      tempco[i][j]     += (error * (256 - frac)) >> (8 + GYRO_BIAS_K);
+      tempco[i][j + 1] += (error * frac)         >> (8 + GYRO_BIAS_K);
+      }
+
+   GYRO_compensate(sensor);
+
+   // the first time the nearer point is learned, have the main loop save the model, so it survives a power cycle
+   // (once per point per startup, which keeps eeprom wear to a few writes per ride)
    //
-   GYRO_x_urate = x;
-   GYRO_y_urate = y;
-   GYRO_z_urate = z;
+   BYTE *fill = &GYRO_temp_fill[sensor][frac < 128 ? j : j + 1];
+   if (*fill < GYRO_TEMP_FILL && ++*fill == GYRO_TEMP_FILL)
+      GYRO_tempco_learned = 1;
+#else
+   volatile SWORD *bias[3] = { &GYRO_x_bias[sensor], &GYRO_y_bias[sensor], &GYRO_z_bias[sensor] };
 
-   // smoothed rates, for general use
+   for (BYTE i = 0; i < 3; ++i)
+      {
+      // pick up any bias set elsewhere meanwhile (by GYRO_calibrate or CONFIG_recall)
+      //
+      if ((GYRO_still[sensor][i].fine + 128) >> 8 != *bias[i])
+         GYRO_still[sensor][i].fine = (SDWORD)*bias[i] << 8;
+
+      SDWORD measured = ((SDWORD)*bias[i] << 8) + (GYRO_still[sensor][i].sum << 8) / GYRO_STILL_SAMPLES;
+      GYRO_still[sensor][i].fine += (measured - GYRO_still[sensor][i].fine) >> GYRO_BIAS_K;
+      *bias[i] = (GYRO_still[sensor][i].fine + 128) >> 8;
+      }
+#endif
+   }
+#endif
+
+// Update smoothed rates, for general use.
+// Called by interrupt.
+//
+PRIVATE void
+GYRO_smooth(SWORD x, SWORD y, SWORD z)
+   {
    // K = low pass filter strength (0=none, 1=weak, 4+=strong)
    //
    const BYTE K = 3;
@@ -90,6 +333,304 @@ MPU_update()
    GYRO_z_srate = z_filter >> K;
    }
 
+// Queue a readout's rotation for the integrator.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
+//
+PRIVATE void
+GYRO_put(SDWORD x, SDWORD y, SDWORD z)
+   {
+   BYTE head = GYRO_head;
+
+   // integrator has fallen behind: add to newest entry, which the consumer isn't touching (it only reads the oldest, and the ring is full)
+   //
+   if ((BYTE)(head - GYRO_tail) == GYRO_RING)
+      {
+      BYTE i = (head - 1) & (GYRO_RING - 1);
+      GYRO_ring[i].x += x;
+      GYRO_ring[i].y += y;
+      GYRO_ring[i].z += z;
+      GYRO_lost += 1;
+      return;
+      }
+
+   BYTE i = head & (GYRO_RING - 1);
+   GYRO_ring[i].x = x;
+   GYRO_ring[i].y = y;
+   GYRO_ring[i].z = z;
+   GYRO_head = head + 1; // publish entry only once it's complete
+   }
+
+#if HAVE_FIFO
+
+// Most samples drained from the fifo per timestep (any excess waits for the next timestep).
+//
+#define GYRO_FIFO_SIZE 8
+
+// Fifo status and sample readouts, delivered by MPU_submit.
+//
+PRIVATE BYTE GYRO_fifo_status[GYRO_FIFO_STATUS_SIZE];
+PRIVATE BYTE GYRO_fifo_data[GYRO_FIFO_SIZE * 6];
+
+// Process a fifo sample readout.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
+//
+PRIVATE void
+GYRO_fifo_done(TWI_XFER *xfer)
+   {
+   // a failed transfer loses its samples
+   //
+   if (xfer->error)
+      return;
+
+   // sum raw sensor readings
+   //
+   SDWORD sx = 0, sy = 0, sz = 0;
+   for (BYTE i = 0; i < xfer->n; i += 6)
+      {
+      SWORD x, y, z;
+      GYRO_decode_xyz(xfer->data + i, &x, &y, &z);
+#if HAVE_BIAS_TRACKING
+      GYRO_track(0, x, y, z);
+#endif
+      sx += x;
+      sy += y;
+      sz += z;
+      }
+
+   // remove zero rate biases
+   //
+   BYTE n = xfer->n / 6;
+   sx -= (SDWORD)n * GYRO_x_bias[0];
+   sy -= (SDWORD)n * GYRO_y_bias[0];
+   sz -= (SDWORD)n * GYRO_z_bias[0];
+
+   // unsmoothed rates, for integrator (which consumes them)
+   //
+   GYRO_put(sx, sy, sz);
+
+   // smoothed rates, from the average of this burst
+   //
+   GYRO_smooth(sx / n, sy / n, sz / n);
+   }
+
+PRIVATE TWI_XFER GYRO_fifo_xfer = { GYRO_DEVICE(0), GYRO_FIFO_REGISTER, 0, GYRO_fifo_data, 1, GYRO_fifo_done };
+
+// Process a fifo status readout by draining the samples it reports.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
+//
+PRIVATE void
+GYRO_status_done(TWI_XFER *xfer)
+   {
+   if (xfer->error || GYRO_fifo_xfer.busy) // previous drain still in progress: leave these samples for next time
+      return;
+
+   WORD n = GYRO_decode_fifo_status(xfer->data);
+   if (n == 0)
+      return;
+   if (n > GYRO_FIFO_SIZE)
+      n = GYRO_FIFO_SIZE;
+
+   GYRO_fifo_xfer.n = n * 6;
+   MPU_submit(&GYRO_fifo_xfer);
+   }
+
+PRIVATE TWI_XFER GYRO_xfer[MPU_SENSORS] = { { GYRO_DEVICE(0), GYRO_FIFO_STATUS_REGISTER, sizeof(GYRO_fifo_status), GYRO_fifo_status, 1, GYRO_status_done } };
+
+#else
+
+// Gyro readouts, delivered by MPU_submit, one per sensor.
+//
+#if HAVE_TEMPCO
+#define GYRO_BURST_REGISTER GYRO_TEMP_REGISTER // temperature, then gyros
+#define GYRO_BURST_SKIP     2                  // bytes preceding the gyro readout
+#else
+#define GYRO_BURST_REGISTER GYRO_REGISTER
+#define GYRO_BURST_SKIP     0
+#endif
+
+PRIVATE BYTE GYRO_data[MPU_SENSORS][GYRO_BURST_SKIP + 6];
+
+PRIVATE TWI_XFER GYRO_xfer[MPU_SENSORS];
+
+// Nominal interval between samples, in TIME_stamp counts.
+//
+#define GYRO_NOMINAL_DT (TIME_STAMP_HZ / IMU_HZ)
+
+// Process a gyro readout.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
+//
+// The sensors are read in back-to-back bursts, which complete in sensor order.
+// Their readings are accumulated as they arrive, and averaged when the last one is in.
+//
+// The average is stamped with its arrival time, and weighted by the time since the previous one before being passed to the integrator.
+// So a late or lost timestep (an interrupt overrun, or a failed transfer) lengthens the interval integrated, rather than dropping it.
+//
+PRIVATE void
+GYRO_done(TWI_XFER *xfer)
+   {
+   static SDWORD sx, sy, sz; // sum of readings received so far this timestep
+   static BYTE   n;          // number of readings received so far this timestep
+
+   // the sums are cleared both when a timestep's first reading arrives and once its last has been consumed,
+   // since either transfer may have been flushed (by MPU_abort), and then its "done" isn't called
+   //
+   BYTE sensor = xfer - GYRO_xfer;
+   if (sensor == 0)
+      sx = sy = sz = n = 0;
+
+   // a failed transfer leaves that sensor out of the average
+   //
+   if (!xfer->error)
+      {
+      // raw sensor readings
+      //
+#if HAVE_TEMPCO
+      // biases for sensor's temperature
+      //
+      GYRO_temp[sensor] = GYRO_decode_temp(xfer->data);
+      GYRO_compensate(sensor);
+#endif
+
+      SWORD x, y, z;
+      GYRO_decode_xyz(xfer->data + GYRO_BURST_SKIP, &x, &y, &z);
+#if HAVE_BIAS_TRACKING
+      GYRO_track(sensor, x, y, z);
+#endif
+
+      // remove zero rate biases
+      //
+      sx += x - GYRO_x_bias[sensor];
+      sy += y - GYRO_y_bias[sensor];
+      sz += z - GYRO_z_bias[sensor];
+      n  += 1;
+      }
+
+   // wait for remaining sensors
+   //
+   if (sensor != MPU_SENSORS - 1)
+      return;
+
+   // if all transfers failed, leave the previous rates in effect
+   //
+   if (n == 0)
+      return;
+
+   SWORD x = sx / n,
+         y = sy / n,
+         z = sz / n;
+   sx = sy = sz = n = 0;
+
+   // time since previous sample
+   // (capped, so the first sample after a pause, such as calibration, isn't taken to span all of it)
+   //
+   static DWORD previous;
+   DWORD now = TIME_stamp();
+   DWORD dt  = now - previous;
+   previous  = now;
+
+   if (dt > 8 * GYRO_NOMINAL_DT)
+      dt = 8 * GYRO_NOMINAL_DT;
+   if (dt > GYRO_NOMINAL_DT * 3 / 2)
+      GYRO_late += 1;
+   if (dt > GYRO_max_dt)
+      GYRO_max_dt = dt;
+
+   // unsmoothed rates, for integrator (which consumes them)
+   //
+   GYRO_put((SDWORD)x * (SWORD)dt, (SDWORD)y * (SWORD)dt, (SDWORD)z * (SWORD)dt);
+
+   // smoothed rates, for general use
+   //
+   GYRO_smooth(x, y, z);
+   }
+
+PRIVATE TWI_XFER GYRO_xfer[MPU_SENSORS] =
+   {
+   { GYRO_DEVICE(0), GYRO_BURST_REGISTER, sizeof(GYRO_data[0]), GYRO_data[0], 1, GYRO_done },
+#if HAVE_DUAL_MPU
+   { GYRO_DEVICE(1), GYRO_BURST_REGISTER, sizeof(GYRO_data[1]), GYRO_data[1], 1, GYRO_done },
+#endif
+   };
+
+#endif
+#endif
+
+#if HAVE_MAGNETOMETER
+// Magnetometer readout, delivered by MPU_submit.
+//
+PRIVATE BYTE MAG_data[6];
+
+// Process a magnetometer readout.
+// Called by interrupt (or directly by MPU_submit, when transfers are polled).
+//
+PRIVATE void
+MAG_done(TWI_XFER *xfer)
+   {
+   if (xfer->error)
+      return;
+
+   SWORD x, y, z;
+   MAG_decode_xyz(xfer->data, &x, &y, &z);
+   MAG_x = x;
+   MAG_y = y;
+   MAG_z = z;
+   MAG_fresh = 1;
+   }
+
+PRIVATE TWI_XFER MAG_xfer = { MAG_DEVICE, MAG_REGISTER, sizeof(MAG_data), MAG_data, 1, MAG_done };
+#endif
+
+// Update mpu data.
+// Called by interrupt.
+// Returned: 1 = readout submitted, 0 = bus still busy with a previous one (this timestep's readout is skipped)
+//
+// With interrupt driven TWI transfers this merely starts a gyro burst and returns; the readout is processed (by GYRO_done) when
+// the burst completes, so the rates seen by the imu integrator are those of the burst started on the previous timestep.
+//
+PRIVATE BOOL
+MPU_update()
+   {
+   // accumulate data for zero rate bias calibration
+   //
+   if (MPU_calibrating)
+      {
+      for (BYTE s = 0; s < MPU_SENSORS; ++s)
+         {
+         SWORD x, y, z;
+         GYRO_read_xyz(s, &x, &y, &z); GYRO_x_sum[s] += x; GYRO_y_sum[s] += y; GYRO_z_sum[s] += z;
+         ACCO_read_xyz(s, &x, &y, &z); ACCO_x_sum[s] += x; ACCO_y_sum[s] += y; ACCO_z_sum[s] += z;
+         }
+      MPU_cnt += 1;
+      return 1;
+      }
+
+   // raw sensor readings (MPU has fresh gyro data available at update rate of 1 KHz)
+   // with HAVE_FIFO,     this reads the fifo status and then drains all the samples it reports, in one burst
+   // with HAVE_DMP,      this reads the fifo status and then the oldest orientation packet it reports
+   // with HAVE_DUAL_MPU, this reads each sensor in turn, in back-to-back bursts
+   // if a previous burst is still outstanding a device has hung the bus: clear it and try again next timestep
+   //
+   BOOL accepted = 1;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      accepted &= MPU_submit(&GYRO_xfer[s]);
+   if (!accepted)
+      MPU_abort();
+
+#if HAVE_MAGNETOMETER
+   // magnetometer readings, at a low rate, queued behind every n-th gyro burst
+   //
+   static BYTE n;
+   if (++n >= IMU_HZ / MAG_HZ)
+      {
+      n = 0;
+      if (!MAG_xfer.busy)
+         MPU_submit(&MAG_xfer);
+      }
+#endif
+
+   return accepted;
+   }
+
 // Fast blink led for N seconds during calibration.
 //
 PRIVATE void
@@ -119,7 +660,8 @@ ACCO_calibrate()
    {
    // accumulate data
    //
-   ACCO_x_sum = ACCO_y_sum = ACCO_z_sum = 0;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      ACCO_x_sum[s] = ACCO_y_sum[s] = ACCO_z_sum[s] = 0;
    MPU_cnt = 0;
 
    MPU_calibrating = 1;
@@ -128,13 +670,16 @@ ACCO_calibrate()
 
    // calculate biases
    //
-   ACCO_x_bias = ACCO_x_sum / MPU_cnt;
-   ACCO_y_bias = ACCO_y_sum / MPU_cnt;
-   ACCO_z_bias = ACCO_z_sum / MPU_cnt;
-   
-   ACCO_z_bias -= MPU_ONE_GEE;
-   
-   printf("acco: cnt=%u bias=(%+d %+d %+d)\n", MPU_cnt, ACCO_x_bias, ACCO_y_bias, ACCO_z_bias);
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      {
+      ACCO_x_bias[s] = ACCO_x_sum[s] / MPU_cnt;
+      ACCO_y_bias[s] = ACCO_y_sum[s] / MPU_cnt;
+      ACCO_z_bias[s] = ACCO_z_sum[s] / MPU_cnt;
+      
+      ACCO_z_bias[s] -= MPU_ONE_GEE;
+      
+      printf("acco%u: cnt=%u bias=(%+d %+d %+d)\n", s, MPU_cnt, ACCO_x_bias[s], ACCO_y_bias[s], ACCO_z_bias[s]);
+      }
    }
 
 // Read gyros for a few seconds and compute biases needed to zero the output rates.
@@ -145,7 +690,8 @@ GYRO_calibrate()
    {
    // accumulate data
    //
-   GYRO_x_sum = GYRO_y_sum = GYRO_z_sum = 0;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      GYRO_x_sum[s] = GYRO_y_sum[s] = GYRO_z_sum[s] = 0;
    MPU_cnt = 0;
 
    MPU_calibrating = 1;
@@ -154,13 +700,95 @@ GYRO_calibrate()
    
    // calculate biases
    //
-   GYRO_x_bias = GYRO_x_sum / MPU_cnt;
-   GYRO_y_bias = GYRO_y_sum / MPU_cnt;
-   GYRO_z_bias = GYRO_z_sum / MPU_cnt;
-   
-   printf("gyro: cnt=%u bias=(%+d %+d %+d)\n", MPU_cnt, GYRO_x_bias, GYRO_y_bias, GYRO_z_bias);
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      {
+      GYRO_x_bias[s] = GYRO_x_sum[s] / MPU_cnt;
+      GYRO_y_bias[s] = GYRO_y_sum[s] / MPU_cnt;
+      GYRO_z_bias[s] = GYRO_z_sum[s] / MPU_cnt;
+
+#if HAVE_TEMPCO
+      // shift bias model to agree, at the temperature seen just before calibration
+      // (the biases are set from it by interrupt, with each reading)
+      //
+      DI();
+      BYTE frac, i = GYRO_temp_point(GYRO_temp[s], &frac);
+      SDWORD dx = ((GYRO_x_sum[s] / MPU_cnt) << 8) - GYRO_temp_bias(GYRO_x_tempco[s], i, frac);
+      SDWORD dy = ((GYRO_y_sum[s] / MPU_cnt) << 8) - GYRO_temp_bias(GYRO_y_tempco[s], i, frac);
+      SDWORD dz = ((GYRO_z_sum[s] / MPU_cnt) << 8) - GYRO_temp_bias(GYRO_z_tempco[s], i, frac);
+      for (BYTE j = 0; j < GYRO_TEMP_POINTS; ++j)
+         {
+         GYRO_x_tempco[s][j] += dx;
+         GYRO_y_tempco[s][j] += dy;
+         GYRO_z_tempco[s][j] += dz;
+         }
+      GYRO_compensate(s);
+      EI();
+#endif
+      
+      printf("gyro%u: cnt=%u bias=(%+d %+d %+d)\n", s, MPU_cnt, GYRO_x_bias[s], GYRO_y_bias[s], GYRO_z_bias[s]);
+      }
+   }
+
+#if HAVE_MAGNETOMETER
+// Read magnetometer for a while, as device is turned every which way, and compute biases (hard iron offsets) that center its readings.
+// Assumption: device is mounted on bike (whose steel and wiring cause the offsets), and is turned through all headings and tilts
+//
+PUBLIC void
+MAG_calibrate()
+   {
+   SWORD x_min = 32767, y_min = 32767, z_min = 32767;
+   SWORD x_max = -32767, y_max = -32767, z_max = -32767;
+
+   LED_off();
+   for (WORD i = 0; i < 20 * MAG_HZ; ++i) // 20 seconds
+      {
+      TIME_pause(1.0 / MAG_HZ);
+
+      DI();
+      SWORD x, y, z;
+      MAG_read_xyz(&x, &y, &z);
+      EI();
+
+      if (x < x_min) x_min = x;
+      if (x > x_max) x_max = x;
+      if (y < y_min) y_min = y;
+      if (y > y_max) y_max = y;
+      if (z < z_min) z_min = z;
+      if (z > z_max) z_max = z;
+
+      if (i % (MAG_HZ / 4) == 0)
+         LED_toggle();
+      }
+   LED_on();
+
+   MAG_x_bias = (x_min + x_max) / 2;
+   MAG_y_bias = (y_min + y_max) / 2;
+   MAG_z_bias = (z_min + z_max) / 2;
+
+   printf("mag: bias=(%+d %+d %+d)\n", MAG_x_bias, MAG_y_bias, MAG_z_bias);
    }
 
+// Get magnetic field vector with respect to gyro reference frame, bias corrected, in equalized (but otherwise arbitrary) units.
+// Returned: 1 = reading is new since last call, 0 = same reading as last call
+//
+PUBLIC BOOL
+MAG_getField(FLOAT *xp, FLOAT *yp, FLOAT *zp)
+   {
+   DI();
+   SWORD x = MAG_x,
+         y = MAG_y,
+         z = MAG_z;
+   BOOL  fresh = MAG_fresh;
+   MAG_fresh = 0;
+   EI();
+
+   *xp = (x - MAG_x_bias);
+   *yp = (y - MAG_y_bias) * MAG_Y_GAIN;
+   *zp = (z - MAG_z_bias);
+   return fresh;
+   }
+#endif
+
 // Get direction of accelerometer vector with respect to ground reference frame, in radians.
 // Note: these angles are only meaningful when the sensor is standing still or moving in a straight line at constant speed.
 //
@@ -168,10 +796,22 @@ PUBLIC void
 ACCO_getRotations(FLOAT *xp, FLOAT *yp)
    {
 #if HAVE_ACCELEROMETERS
-   DI();
-   SWORD x, y, z;
-   ACCO_read_xyz(&x, &y, &z);
-   EI();
+   // bias corrected readings, averaged over sensors
+   //
+   SDWORD sx = 0, sy = 0, sz = 0;
+   for (BYTE s = 0; s < MPU_SENSORS; ++s)
+      {
+      DI();
+      SWORD x, y, z;
+      ACCO_read_xyz(s, &x, &y, &z);
+      EI();
+      sx += x - ACCO_x_bias[s];
+      sy += y - ACCO_y_bias[s];
+      sz += z - ACCO_z_bias[s];
+      }
+   SWORD x = sx / MPU_SENSORS,
+         y = sy / MPU_SENSORS,
+         z = sz / MPU_SENSORS;
    
    // apply some smoothing
    // K = low pass filter strength (0=none, 1=weak, 4+=strong)
@@ -187,38 +827,91 @@ ACCO_getRotations(FLOAT *xp, FLOAT *yp)
    x = x_filter >> K;
    y = y_filter >> K;
    z = z_filter >> K;
-
-   x -= ACCO_x_bias;
-   y -= ACCO_y_bias;
-   z -= ACCO_z_bias;
     
-   FLOAT ax = x * MPU_ACCO_SCALE_FACTOR,
-         ay = y * MPU_ACCO_SCALE_FACTOR,
-         az = z * MPU_ACCO_SCALE_FACTOR;
-
-   *xp = atan2(ay, az);                       // roll
-   *yp = atan2(-ax, sqrt(ay * ay + az * az)); // pitch
+   // (the angles are independent of scale, so we can work in sensor digits)
+   //
+   SDWORD yz;
+   *xp = FIXED_TO_FLOAT(CORDIC_polar(z, y, &yz));  // roll  = atan2(y, z),                 yz = sqrt(y * y + z * z)
+   *yp = FIXED_TO_FLOAT(CORDIC_atan2(-x, yz));     // pitch = atan2(-x, sqrt(y * y + z * z))
 #else
    *xp = *yp = 0;
 #endif
    }
 
-// Calculate how far gyros have turned during current imu timestep, in radians.
-// Note: we use unsmoothed rates to minimize imu lag (any jitter will get averaged out by imu integrator).
+#if HAVE_DMP
+// Get orientation computed by dmp, as a unit quaternion (1.0 == 16384).
 //
 PUBLIC void
-GYRO_getRotations(FLOAT *xp, FLOAT *yp, FLOAT *zp)
+GYRO_getQuaternion(SWORD *wp, SWORD *xp, SWORD *yp, SWORD *zp)
    {
    DI();
-   SWORD x = GYRO_x_urate,
-         y = GYRO_y_urate,
-         z = GYRO_z_urate;
+   *wp = GYRO_qw;
+   *xp = GYRO_qx;
+   *yp = GYRO_qy;
+   *zp = GYRO_qz;
    EI();
+   }
 
-   #define IMU_TIMESTEP (1.0 / IMU_HZ)
-   *xp = x * MPU_GYRO_SCALE_FACTOR * IMU_TIMESTEP; // roll
-   *yp = y * MPU_GYRO_SCALE_FACTOR * IMU_TIMESTEP; // pitch
-   *zp = z * MPU_GYRO_SCALE_FACTOR * IMU_TIMESTEP; // yaw
+// See if any gyro readouts are waiting for the integrator.
+// Returned: 0 (orientation is computed by dmp, nothing is queued)
+//
+PUBLIC BOOL
+GYRO_queued()
+   {
+   return 0;
+   }
+#else
+// See if any gyro readouts are waiting for the integrator.
+// Returned: 1 = yes, 0 = queue empty
+//
+PUBLIC BOOL
+GYRO_queued()
+   {
+   return GYRO_tail != GYRO_head;
+   }
+
+// Calculate how far gyros have turned during the oldest timestep not yet integrated, in radians.
+// Note: we use unsmoothed rates to minimize imu lag (any jitter will get averaged out by imu integrator).
+// Returned: 1 = rotations taken from queue, 0 = queue empty (rotations untouched)
+//
+// This is the rotation over all samples acquired during that timestep, however many there were:
+// with HAVE_FIFO, at the sensor's sample rate, otherwise over the measured time since the previous one.
+//
+PUBLIC BOOL
+GYRO_getRotations(FLOAT *xp, FLOAT *yp, FLOAT *zp)
+   {
+   BYTE tail = GYRO_tail;
+   if (tail == GYRO_head)
+      return 0;
+
+   BYTE i = tail & (GYRO_RING - 1);
+   SDWORD x = GYRO_ring[i].x,
+          y = GYRO_ring[i].y,
+          z = GYRO_ring[i].z;
+   GYRO_tail = tail + 1; // release entry only once it's been copied
+
+#if HAVE_FIFO
+   #define GYRO_TIMESTEP (1.0 / GYRO_FIFO_HZ) // per sample
+#else
+   #define GYRO_TIMESTEP (1.0 / TIME_STAMP_HZ) // per timestamp count
+#endif
+
+   *xp = x * MPU_GYRO_SCALE_FACTOR * GYRO_TIMESTEP; // roll
+   *yp = y * MPU_GYRO_SCALE_FACTOR * GYRO_TIMESTEP; // pitch
+   *zp = z * MPU_GYRO_SCALE_FACTOR * GYRO_TIMESTEP; // yaw
+   return 1;
+   }
+
+// Get number of readouts that found the integrator's queue full (since startup).
+// Their rotations are merged with the preceding readout's and integrated together, rather than dropped.
+//
+PUBLIC WORD
+GYRO_getLost()
+   {
+   DI();
+   WORD n = GYRO_lost;
+   EI();
+   return n;
    }
 
 // Get (smoothed) gyro rates, in radians/sec.
@@ -252,3 +945,20 @@ GYRO_getYawRate()
    EI();
    return z * MPU_GYRO_SCALE_FACTOR;
    }
+
+#if !HAVE_FIFO
+// Get sample timing statistics.
+// Taken: places to put number of late samples (since startup) and longest interval between samples (since previous call), in seconds
+//
+PUBLIC void
+GYRO_getTiming(WORD *late, FLOAT *max_dt)
+   {
+   DI();
+   *late = GYRO_late;
+   WORD m = GYRO_max_dt;
+   GYRO_max_dt = 0;
+   EI();
+   *max_dt = m * (1.0 / TIME_STAMP_HZ);
+   }
+#endif
+#endif
@@ -0,0 +1,209 @@
+// Controller for Invensense MPU6000 or ICM-20602 on spi bus [ 3 gyros + 3 accelerometers ].
+//
+// Units: SPI
+// Ports: PORTB2 PORTB3 PORTB4 PORTB5
+//
+//                gyros                     accelerometers
+//                -----                     --------------
+// update rate:   200 Hz                    200 Hz
+// bandwidth:     188 Hz                    184 Hz
+// range:         +/- 250 deg/sec           +/- 2 gee
+// sensitivity:   131 digits per deg/sec    16384 digits per gee
+//
+// These parts share the MPU6050's register map and settings, so they share its readout decoding and scale factors ("invensense-common.h").
+// A 6 byte gyro burst takes ~15us at 4 MHz, against several hundred us for TWI at 200 KHz, so transfers are simply polled.
+//
+// With HAVE_SPI_IMU == 2 the sensor is replaced by a software model of it (see below).
+
+// --------------------------------------------------------------------
+// Implementation.
+// --------------------------------------------------------------------
+
+#if HAVE_FIFO || HAVE_DMP || HAVE_DUAL_MPU || HAVE_MAGNETOMETER
+#error  HAVE_FIFO, HAVE_DMP, HAVE_DUAL_MPU, and HAVE_MAGNETOMETER are not supported for spi sensors
+#endif
+
+// Registers.
+//
+#define MPU_SMPLRT_DIV       0x19
+#define MPU_CONFIG           0x1A
+#define MPU_GYRO_CONFIG      0x1B
+#define MPU_ACCO_CONFIG      0x1C
+
+#define MPU_INT_PIN_CFG      0x37
+#define MPU_INT_ENABLE       0x38
+
+#define MPU_ACCO_XOUT_H      0x3B
+#define MPU_TEMP_OUT_H       0x41
+#define MPU_GYRO_XOUT_H      0x43
+
+#define MPU_SIGNAL_PATH_RST  0x68
+#define MPU_USER_CTRL        0x6A
+#define MPU_PWR_MGMT_1       0x6B
+#define MPU_WHO_AM_I         0x75
+
+#define MPU_ICM20602_ID      0x12 // WHO_AM_I value (MPU6000 is 0x68)
+
+// Gyro and accelerometer readouts, as spi bursts.
+//
+#define GYRO_DEVICE(SENSOR) 0 // unused
+#define GYRO_REGISTER       MPU_GYRO_XOUT_H
+#define ACCO_DEVICE(SENSOR) 0 // unused
+#define ACCO_REGISTER       MPU_ACCO_XOUT_H
+#define GYRO_TEMP_REGISTER  MPU_TEMP_OUT_H // temperature, followed by a GYRO_REGISTER readout
+
+#include "./invensense-common.h" // readout decoding, scale factors
+
+// Read gyro sensors.
+// Taken: sensor number (ignored, there's only one)
+//
+PRIVATE void
+GYRO_read_xyz(BYTE sensor, SWORD *x, SWORD *y, SWORD *z)
+   {
+   BYTE b[6];
+   SPI_read_multi(GYRO_REGISTER, sizeof(b), b);
+   GYRO_decode_xyz(b, x, y, z);
+   }
+
+// Read accelerometer sensors.
+// Taken: sensor number (ignored, there's only one)
+//
+PRIVATE void
+ACCO_read_xyz(BYTE sensor, SWORD *x, SWORD *y, SWORD *z)
+   {
+   BYTE b[6];
+   SPI_read_multi(ACCO_REGISTER, sizeof(b), b);
+   ACCO_decode_xyz(b, x, y, z);
+   }
+
+// Write consecutive sensor registers.
+// Configuration registers are limited to 1 MHz, so they're written at the slow clock, after which the fast clock is restored for reads.
+//
+PRIVATE void
+MPU_write_registers(BYTE register_number, BYTE n, BYTE *values)
+   {
+   SPI_init(0);
+   for (BYTE i = 0; i < n; ++i)
+      SPI_write(register_number + i, values[i]);
+   SPI_init(1);
+   }
+
+// Carry out a sensor transfer (device address is ignored), calling its "done" function before returning.
+// Returned: 1 (always accepted)
+//
+PRIVATE BOOL
+MPU_submit(TWI_XFER *xfer)
+   {
+   if (xfer->read)
+      SPI_read_multi(xfer->register_number, xfer->n, xfer->data);
+   else
+      MPU_write_registers(xfer->register_number, xfer->n, xfer->data);
+
+   xfer->error = 0;
+   if (xfer->done)
+      xfer->done(xfer);
+   return 1;
+   }
+
+// Abandon sensor transfers (nothing to do: they complete immediately).
+//
+PRIVATE void
+MPU_abort()
+   {
+   }
+
+// Write a sensor register.
+//
+PRIVATE void
+MPU_write(BYTE register_number, BYTE value)
+   {
+   MPU_write_registers(register_number, 1, &value);
+   }
+
+#if SPI_MODEL
+// Software model of the sensor, standing in for it on the spi bus so the firmware can be exercised on a bare board.
+// It identifies itself as an MPU6000, reports the device upright and level (1 gee along sensor x axis), and a roll rate
+// (sensor y axis) alternating between +20 and -20 deg/sec every 2 seconds, so the camera visibly rocks back and forth.
+// Register writes are accepted and ignored.
+//
+PRIVATE BYTE SPI_model_register; // register being accessed
+PRIVATE BOOL SPI_model_addressed; // has register number been received?
+
+static void
+SPI_model_select()
+   {
+   SPI_model_addressed = 0;
+   }
+
+static BYTE
+SPI_model_transfer(BYTE b)
+   {
+   if (!SPI_model_addressed)
+      {
+      SPI_model_register  = b & ~SPI_READ;
+      SPI_model_addressed = 1;
+      return 0;
+      }
+
+   BYTE r = SPI_model_register++; // registers auto-increment
+
+   if (r == MPU_WHO_AM_I)
+      return 0x68;
+
+   // 16 bit readouts, high byte first: accelerometer x, y, z, temperature, gyro x, y, z
+   //
+   if (r < MPU_ACCO_XOUT_H || r >= MPU_ACCO_XOUT_H + 14)
+      return 0;
+
+   extern volatile TICKS ISR_Ticks;
+   BYTE  i = r - MPU_ACCO_XOUT_H;
+   SWORD v;
+   switch (i >> 1)
+      {
+      case 0:  v = 16384;                                                               break; // accelerometer x: 1 gee
+      case 5:  v = ((ISR_Ticks / (2 * TICKER_HZ)) & 1) ? 20 * 131 : -20 * 131;          break; // gyro y: +/- 20 deg/sec
+      default: v = 0;                                                                   break;
+      }
+   return (i & 1) ? (v & 0xFF) : (v >> 8);
+   }
+#endif
+
+// --------------------------------------------------------------------
+// Interface.
+// --------------------------------------------------------------------
+
+// Prepare gyros and accelerometers for use.
+//
+PUBLIC void
+MPU_init()
+   {
+   SPI_init(0);                                    // configuration registers are limited to 1 MHz
+
+   SPI_write(MPU_PWR_MGMT_1,      0x80);           // device reset
+   delay_ms(100);                                  // wait for reset to complete
+   SPI_write(MPU_SIGNAL_PATH_RST, 0x07);           // reset gyro, accel, temp signal paths
+   delay_ms(100);                                  // wait for reset to complete
+   SPI_write(MPU_USER_CTRL,       0x10);           // disable i2c interface (spi only)
+   SPI_write(MPU_PWR_MGMT_1,      0x01);           // sleep = off, clock source = x gyro
+   delay_ms(5);                                    // wait for wakeup to complete
+
+   SPI_write(MPU_CONFIG,          0x01);           // filter b/w  = 188 Hz, gyro output rate = 1000Hz
+   SPI_write(MPU_GYRO_CONFIG,     0x00);           // gyro  scale = 250 deg/sec
+   SPI_write(MPU_ACCO_CONFIG,     0x00);           // accel scale = 2 gee
+#if HAVE_DATA_READY
+   #if 1000 % IMU_HZ
+   #error IMU_HZ must divide the 1000 Hz gyro output rate
+   #endif
+   SPI_write(MPU_SMPLRT_DIV,      1000 / IMU_HZ - 1); // sample rate = IMU_HZ
+   SPI_write(MPU_INT_PIN_CFG,     0x00);           // INT pin active high, push-pull, 50us pulse per sample
+   SPI_write(MPU_INT_ENABLE,      0x01);           // interrupt on "data ready"
+#else
+   SPI_write(MPU_SMPLRT_DIV,      0x04);           // sample rate = 200 Hz
+#endif
+
+   SPI_init(1);                                    // sensor registers can be read at up to 10 MHz (ICM-20602) or 20 MHz (MPU6000)
+
+   BYTE id = SPI_read(MPU_WHO_AM_I);
+   MPU_icm = (id == MPU_ICM20602_ID);
+   printf("spi imu id=%02x %.1f digits per deg/sec\n", id, 1.0 / RAD_TO_DEG(MPU_GYRO_SCALE_FACTOR));
+   }
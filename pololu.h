@@ -7,7 +7,7 @@
 //
 //                gyros                     accelerometers
 //                -----                     --------------
-// update rate:   200 Hz                    50 Hz
+// update rate:   200 Hz                    50 Hz       (gyros: 380/760 Hz or 400/800 Hz with HAVE_FIFO)
 // bandwidth:     70 Hz                     ODR/9 = 50/9 = 5 Hz
 // range:         +/- 250 deg/sec           +/- 2 gee
 // sensitivity:   114 digits per deg/sec    1000 digits per gee
@@ -17,6 +17,26 @@
 // Implementation.
 // --------------------------------------------------------------------
 
+#if HAVE_DATA_READY
+#error  HAVE_DATA_READY is not supported for Pololu sensors
+#endif
+
+#if HAVE_DMP
+#error  HAVE_DMP is not supported for Pololu sensors
+#endif
+
+#if HAVE_DUAL_MPU
+#error  HAVE_DUAL_MPU is not supported for Pololu sensors
+#endif
+
+#if HAVE_TEMPCO
+#error  HAVE_TEMPCO is not supported for Pololu sensors
+#endif
+
+#if HAVE_MAGNETOMETER && !(HAVE_POLOLU == 2 && HAVE_ACCELEROMETERS)
+#error  HAVE_MAGNETOMETER needs a MinIMU-9 (LSM303DLHC)
+#endif
+
 // Gyros.
 //
 #if   HAVE_POLOLU == 2
@@ -27,6 +47,7 @@
 #error  GYRO_ADDR
 #endif
 
+#define GYRO_WHO_AM_I     0x0F
 #define GYRO_CTRL_REG1    0x20
 #define GYRO_CTRL_REG2    0x21
 #define GYRO_CTRL_REG3    0x22
@@ -43,6 +64,9 @@
 #define GYRO_OUT_Z_L      0x2C
 #define GYRO_OUT_Z_H      0x2D
 
+#define GYRO_FIFO_CTRL    0x2E
+#define GYRO_FIFO_SRC     0x2F
+
 // Accelerometers.
 //
 #define ACCO_ADDR 0x19 // LSM303DLHC
@@ -63,38 +87,160 @@
 #define ACCO_OUT_Z_L      0x2C
 #define ACCO_OUT_Z_H      0x2D
 
-// Read gyro sensors, mapping sensor axes to body axes such that:
+// Magnetometer.
+//
+#define MAG_ADDR 0x1E // LSM303DLHC
+
+#define MAG_CRA_REG       0x00
+#define MAG_CRB_REG       0x01
+#define MAG_MR_REG        0x02
+
+#define MAG_OUT_X_H       0x03 // note: x, z, y order, high byte first
+#define MAG_OUT_X_L       0x04
+#define MAG_OUT_Z_H       0x05
+#define MAG_OUT_Z_L       0x06
+#define MAG_OUT_Y_H       0x07
+#define MAG_OUT_Y_L       0x08
+
+// Gyro and accelerometer readouts, as TWI bursts.
+//
+#define GYRO_DEVICE(SENSOR) GYRO_ADDR
+#define GYRO_REGISTER       (GYRO_OUT_X_L | TWI_AUTO_INCREMENT)
+#define ACCO_DEVICE(SENSOR) ACCO_ADDR
+#define ACCO_REGISTER       (ACCO_OUT_X_L | TWI_AUTO_INCREMENT)
+
+// Magnetometer readout, as TWI burst (its register number auto-increments without TWI_AUTO_INCREMENT).
+//
+#define MAG_DEVICE        MAG_ADDR
+#define MAG_REGISTER      MAG_OUT_X_H
+
+// Sensor transfers go via TWI.
+//
+#define MPU_submit TWI_submit
+#define MPU_abort  TWI_abort
+
+// Sensors and register read by TWI_probe to find the fastest clock rate the wiring supports.
+//
+#define MPU_PROBE_DEVICES  { GYRO_ADDR }
+#define MPU_PROBE_REGISTER GYRO_WHO_AM_I
+
+#if HAVE_FIFO
+// Gyro fifo readouts, as TWI bursts.
+// In stream mode the 32 sample fifo always holds the latest samples, captured at the gyro output data rate (ODR), discarding the oldest
+// when full. Each is 6 bytes, laid out like a GYRO_REGISTER readout, and with the fifo enabled an auto-incrementing read of the output
+// registers wraps from OUT_Z_H back to OUT_X_L, so a single burst pops any number of samples.
+//
+#define GYRO_FIFO_ODR 2 // 2 => 380 Hz (L3GD20) or 400 Hz (L3G4200D), 100 or 110 Hz bandwidth
+                        // 3 => 760 Hz (L3GD20) or 800 Hz (L3G4200D), 100 or 110 Hz bandwidth
+
+#if   HAVE_POLOLU == 2 && GYRO_FIFO_ODR == 2
+#define GYRO_FIFO_HZ 380
+#elif HAVE_POLOLU == 2 && GYRO_FIFO_ODR == 3
+#define GYRO_FIFO_HZ 760
+#elif HAVE_POLOLU == 1 && GYRO_FIFO_ODR == 2
+#define GYRO_FIFO_HZ 400
+#elif HAVE_POLOLU == 1 && GYRO_FIFO_ODR == 3
+#define GYRO_FIFO_HZ 800
+#else
+#error  GYRO_FIFO_ODR
+#endif
+
+// Watermark: fifo level corresponding to one imu timestep's worth of samples (reported in GYRO_FIFO_SRC, which is polled each tick).
+// The DRDY/INT2 pin isn't wired on these boards, so GYRO_CTRL_REG3 keeps its default: no interrupt outputs.
+//
+#define GYRO_FIFO_WATERMARK ((GYRO_FIFO_HZ + IMU_HZ - 1) / IMU_HZ)
+
+#define GYRO_FIFO_STATUS_REGISTER GYRO_FIFO_SRC
+#define GYRO_FIFO_STATUS_SIZE     1
+#define GYRO_FIFO_REGISTER        (GYRO_OUT_X_L | TWI_AUTO_INCREMENT)
+
+// Decode fifo status readout.
+// Returned: number of gyro samples waiting in fifo
+//
+PRIVATE WORD
+GYRO_decode_fifo_status(BYTE *b)
+   {
+   if (b[0] & 0x20) return 0;      // empty
+   if (b[0] & 0x40) return 32;     // overrun: full, oldest samples have been discarded
+   return b[0] & 0x1F;             // stored data level
+   }
+#endif
+
+// Decode gyro sensor readout, mapping sensor axes to body axes such that:
 //    x points ahead (body roll axis)
 //    y points right (body pitch axis)
 //    z points down  (body yaw axis)
 //    signs respect right hand rule
 //
 PRIVATE void
-GYRO_read_xyz(SWORD *x, SWORD *y, SWORD *z)
+GYRO_decode_xyz(BYTE *b, SWORD *x, SWORD *y, SWORD *z)
    {
-   BYTE b[6];
-   TWI_read_multi(GYRO_ADDR, GYRO_OUT_X_L | TWI_AUTO_INCREMENT, sizeof(b), b);
-
    *z = - (b[0] | (b[1] << 8)); // X sensor
    *x = - (b[2] | (b[3] << 8)); // Y sensor
    *y =   (b[4] | (b[5] << 8)); // Z sensor
    }
 
-// Read accelerometer sensors, mapping sensor axes to body axes such that:
+// Decode accelerometer sensor readout, mapping sensor axes to body axes such that:
 //    x points ahead (body roll axis)
 //    y points right (body pitch axis)
 //    z points down  (body yaw axis)
 //
+#if HAVE_ACCELEROMETERS
 PRIVATE void
-ACCO_read_xyz(SWORD *x, SWORD *y, SWORD *z)
+ACCO_decode_xyz(BYTE *b, SWORD *x, SWORD *y, SWORD *z)
    {
-#if HAVE_ACCELEROMETERS
-   BYTE b[6];
-   TWI_read_multi(ACCO_ADDR, ACCO_OUT_X_L | TWI_AUTO_INCREMENT, sizeof(b), b);
-   
    *z =   (((b[1] << 8) | b[0]) >> 4); // X sensor
    *x =   (((b[3] << 8) | b[2]) >> 4); // Y sensor
    *y = - (((b[5] << 8) | b[4]) >> 4); // Z sensor
+   }
+#endif
+
+#if HAVE_MAGNETOMETER
+// Decode magnetometer sensor readout, mapping sensor axes to body axes (as for accelerometers, which share its die) such that:
+//    x points ahead (body roll axis)
+//    y points right (body pitch axis)
+//    z points down  (body yaw axis)
+//
+PRIVATE void
+MAG_decode_xyz(BYTE *b, SWORD *x, SWORD *y, SWORD *z)
+   {
+   *z =   ((b[0] << 8) | b[1]); // X sensor
+   *x =   ((b[4] << 8) | b[5]); // Y sensor
+   *y = - ((b[2] << 8) | b[3]); // Z sensor
+   }
+
+// Read magnetometer sensors.
+//
+PRIVATE void
+MAG_read_xyz(SWORD *x, SWORD *y, SWORD *z)
+   {
+   BYTE b[6];
+   TWI_read_multi(MAG_DEVICE, MAG_REGISTER, sizeof(b), b);
+   MAG_decode_xyz(b, x, y, z);
+   }
+#endif
+
+// Read gyro sensors.
+// Taken: sensor number (ignored, there's only one)
+//
+PRIVATE void
+GYRO_read_xyz(BYTE sensor, SWORD *x, SWORD *y, SWORD *z)
+   {
+   BYTE b[6];
+   TWI_read_multi(GYRO_DEVICE(sensor), GYRO_REGISTER, sizeof(b), b);
+   GYRO_decode_xyz(b, x, y, z);
+   }
+
+// Read accelerometer sensors.
+// Taken: sensor number (ignored, there's only one)
+//
+PRIVATE void
+ACCO_read_xyz(BYTE sensor, SWORD *x, SWORD *y, SWORD *z)
+   {
+#if HAVE_ACCELEROMETERS
+   BYTE b[6];
+   TWI_read_multi(ACCO_DEVICE(sensor), ACCO_REGISTER, sizeof(b), b);
+   ACCO_decode_xyz(b, x, y, z);
 #else
    *x = *y = *z = 0;
 #endif
@@ -106,6 +252,12 @@ ACCO_read_xyz(SWORD *x, SWORD *y, SWORD *z)
 #define MPU_ACCO_SCALE_FACTOR            .001    // gees per digit
 #define MPU_ONE_GEE                      1000    // accelerometer reading corresponding to 1 gee acceleration
 
+// Magnetometer rate and gains.
+// At +/- 1.3 gauss the sensor's z axis (body y axis) reads 980 digits per gauss, its x and y axes 1100.
+//
+#define MAG_HZ     25             // readout rate (sensor output rate is 30 Hz)
+#define MAG_Y_GAIN (1100. / 980.) // scales body y readings to match x and z
+
 // --------------------------------------------------------------------
 // Interface.
 // --------------------------------------------------------------------
@@ -118,8 +270,19 @@ MPU_init()
    
    { // gyros
 
+#if HAVE_FIFO
+   // GYRO_FIFO_HZ data rate, highest bandwidth, power on, enable all axes
+   TWI_write(GYRO_ADDR, GYRO_CTRL_REG1, (GYRO_FIFO_ODR << 6) | 0x3F); // xx11.1111
+
+   // fifo enable
+   TWI_write(GYRO_ADDR, GYRO_CTRL_REG5, 0x40); // 0100.0000
+
+   // stream mode, watermark
+   TWI_write(GYRO_ADDR, GYRO_FIFO_CTRL, 0x40 | GYRO_FIFO_WATERMARK); // 010w.wwww
+#else
    // 200 Hz data rate, 70 Hz bandwidth, power on, enable all axes
    TWI_write(GYRO_ADDR, GYRO_CTRL_REG1, 0x7F); // 0111.1111
+#endif
 
    // 250 deg/sec scale, block (atomic) updates to LSB,MSB data pairs
    TWI_write(GYRO_ADDR, GYRO_CTRL_REG4, 0x80); // 1000.0000
@@ -127,7 +290,7 @@ MPU_init()
    // read sensors once to restart adc after changing settings
    SWORD x, y, z;
    while ((TWI_read(GYRO_ADDR, GYRO_STATUS_REG) & 8) == 0) ;
-   GYRO_read_xyz(&x, &y, &z);
+   GYRO_read_xyz(0, &x, &y, &z);
    }
    
 #if HAVE_ACCELEROMETERS
@@ -142,7 +305,21 @@ MPU_init()
    // read sensors once to restart adc after changing settings
    SWORD x, y, z;
    while ((TWI_read(ACCO_ADDR, ACCO_STATUS_REG) & 8) == 0) ;
-   ACCO_read_xyz(&x, &y, &z);
+   ACCO_read_xyz(0, &x, &y, &z);
+   }
+#endif
+
+#if HAVE_MAGNETOMETER
+   { // magnetometer
+
+   // 30 Hz data rate, temperature sensor off
+   TWI_write(MAG_ADDR, MAG_CRA_REG, 0x14); // 0001.0100
+
+   // +/- 1.3 gauss scale
+   TWI_write(MAG_ADDR, MAG_CRB_REG, 0x20); // 0010.0000
+
+   // continuous conversion
+   TWI_write(MAG_ADDR, MAG_MR_REG,  0x00); // 0000.0000
    }
 #endif
    
@@ -1,9 +1,10 @@
 // Servo controller.
 //
-// Units:     TIMER1
-// Counters:  TCNT1
-// Registers: ICR1A, OCR1A
-// Ports:     PORTB1
+// Units:      TIMER1
+// Counters:   TCNT1
+// Registers:  ICR1A, OCR1A
+// Interrupts: TIMER1_CAPT
+// Ports:      PORTB1
 
 // --------------------------------------------------------------------
 // Interface.
@@ -22,6 +23,12 @@ PUBLIC FLOAT SERVO_rgain;
 //
 PUBLIC BOOL SERVO_reverse;
 
+// Note: the above trims are read by interrupt [see SERVO_counts()], so they must only be changed while it's stopped [see SERVO_stop()].
+
+// Time spent by interrupt in computing the latest pulse width.
+//
+PUBLIC volatile COUNTS SERVO_Duration;
+
 // Prepare servo interface for use.
 //
 PUBLIC void
@@ -42,6 +49,8 @@ SERVO_init()
    //
    // 16e6 / 8 / (2e4 upcounts + 2e4 downcounts) = .5e2 = 50 Hz
    //
+   // (TOP is 10,000 at 8MHz and 25,000 at 20MHz, see "clock.h").
+   //
    //                     . _ _ _ _ _ _ _ _ _ TCNT1 == TOP == ICR1 = 20,000
    //                   .   .               .
    //                 .       .           .
@@ -78,23 +87,10 @@ SERVO_init()
           | (0 << CS12)   // timer clock = system clock / 8
           ;
 
-#if CLOCK_MHZ == 16
-
-   ICR1 = 20000;                        // TOP value for waveform width of 20ms at 16Mhz/8
-   #define SERVO_CENTER_COUNTS     1500 // pwm counts for 0 degrees of servo rotation
-   #define SERVO_COUNTS_PER_DEGREE 10   // pwm counts per degree of servo rotation
-   #define SERVO_LIMIT_TENTHS      900  // +/- travel limit, in tenths of a degree
-   
-#elif CLOCK_MHZ == 8
-
-   ICR1 = 10000;                       // TOP value for waveform width of 20ms at 8Mhz/8
-   #define SERVO_CENTER_COUNTS     750 // pwm counts for 0 degrees of servo rotation
-   #define SERVO_COUNTS_PER_DEGREE 5   // pwm counts per degree of servo rotation
-   #define SERVO_LIMIT_TENTHS      900 // +/- travel limit, in tenths of a degree
-
-#else
-   #error CLOCK_MHZ
-#endif
+   ICR1 = CLOCK_SERVO_TOP;                                               // TOP value for waveform width of 1/SERVO_HZ (20ms)
+   #define SERVO_CENTER_COUNTS         (CLOCK_SERVO_COUNTS_PER_MS * 3 / 2) // pwm counts for 0 degrees of servo rotation (1.5ms)
+   #define SERVO_COUNTS_PER_10_DEGREES (CLOCK_SERVO_COUNTS_PER_MS / 10)    // pwm counts per 10 degrees of servo rotation (10us per degree)
+   #define SERVO_LIMIT_TENTHS          900                                 // +/- travel limit, in tenths of a degree
    
    // set center position
    //
@@ -106,11 +102,12 @@ SERVO_init()
    DDRB |= (1 << DDB1);   // enable PORTB1 as output for use by OC1A
    }
 
-// Turn servo to specified shaft angle.
-// Taken: shaft angle, in radians
+// Compute pulse width for specified shaft angle.
+// Taken:    shaft angle, in radians
+// Returned: pwm counter value
 //
-PUBLIC void
-SERVO_setShaftAngle(FLOAT angle)
+PRIVATE WORD
+SERVO_counts(FLOAT angle)
    {
    angle += SERVO_center;
    
@@ -128,9 +125,43 @@ SERVO_setShaftAngle(FLOAT angle)
    else if (target > +SERVO_LIMIT_TENTHS) target = +SERVO_LIMIT_TENTHS;
 
    // convert to PWM counter value
-   OCR1A = SERVO_CENTER_COUNTS + (target * SERVO_COUNTS_PER_DEGREE) / 10;
+   return SERVO_CENTER_COUNTS + ((SDWORD)target * SERVO_COUNTS_PER_10_DEGREES) / 100;
+   }
 
-// printf(" servo: %+6.1f->%+6d\r", RAD_TO_DEG(angle), OCR1A);
+// Interrupt service routine executed once per pwm frame, when TCNT1 reaches TOP (ICR1), midway between pulses.
+//
+// OCR1A is double buffered: a value written now is picked up when TCNT1 reaches BOTTOM, 10 ms later, which is the middle of the next pulse.
+// So the pulse is computed from the latest orientation exactly once per frame, and always a fixed time before it takes effect.
+//
+ISR(TIMER1_CAPT_vect)
+   {
+   COUNTS start = COUNTER_get();
+
+   // track camera to horizon
+   // (if we've interrupted the integrator while it publishes an update, keep the previous pulse width for this frame)
+   //
+   FLOAT roll;
+   if (IMU_trySnapshot(&roll, 0, 0))
+      OCR1A = SERVO_counts(roll);
+
+   SERVO_Duration = COUNTER_get() - start;
+   }
+
+// Start tracking camera to horizon.
+//
+PUBLIC void
+SERVO_start()
+   {
+   TIFR1  =  (1 << ICF1);  // discard any TOP seen before now
+   TIMSK1 |= (1 << ICIE1); // enable "TIMER1 capture" interrupts, which signal TOP when ICR1 is TOP (and pin ICP1 is then ignored)
+   }
+
+// Stop tracking camera to horizon (servo holds its position).
+//
+PUBLIC void
+SERVO_stop()
+   {
+   TIMSK1 &= ~(1 << ICIE1);
    }
 
 #if 0 // UNUSED
@@ -144,10 +175,10 @@ SERVO_test()
       {
       switch(USART_get())
          {
-         case 'c': OCR1A  = SERVO_CENTER_COUNTS;     break;
-         case 'j': OCR1A += SERVO_COUNTS_PER_DEGREE; break;
-         case 'k': OCR1A -= SERVO_COUNTS_PER_DEGREE; break;
-         case 'q': goto done;                        break;
+         case 'c': OCR1A  = SERVO_CENTER_COUNTS;              break;
+         case 'j': OCR1A += SERVO_COUNTS_PER_10_DEGREES / 10; break;
+         case 'k': OCR1A -= SERVO_COUNTS_PER_10_DEGREES / 10; break;
+         case 'q': goto done;                                 break;
          }
       printf("%5u\r", OCR1A);
       }
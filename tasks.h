@@ -0,0 +1,101 @@
+// Multi-rate task scheduler, for the main loop's jobs.
+//
+// Each task is released every "period" ticks, and run by the first TASK_run() that finds it due (tasks due together run in table order).
+// Its lateness (time from release to start) is tracked, and a start later than its "deadline" counts as an overrun.
+// An overrun task isn't run repeatedly to catch up: its releases resume a full period after the late start.
+// Between tasks, TASK_idle() puts the cpu to sleep until something happens.
+//
+
+// --------------------------------------------------------------------
+// Interface.
+// --------------------------------------------------------------------
+
+typedef struct
+   {
+   const char *name;     // for display
+   void      (*job)();   // work to do
+   TICKS       period;   // interval between releases, in ticks
+   TICKS       deadline; // latest acceptable start, in ticks after release
+   TICKS       release;  // time of next release
+   TICKS       late;     // worst lateness seen, in ticks
+   WORD        overruns; // number of starts later than deadline
+   } TASK;
+
+// Interval between releases of a task run at HZ rate, in ticks.
+//
+#define TASK_TICKS(HZ) (TICKER_HZ / (HZ))
+
+// Begin scheduling, with all tasks due now and their statistics cleared.
+//
+PUBLIC void
+TASK_start(TASK *tasks, BYTE n)
+   {
+   TICKS now = TIME_now();
+   for (TASK *t = tasks; t < tasks + n; ++t)
+      {
+      t->release  = now;
+      t->late     = 0;
+      t->overruns = 0;
+      }
+
+   set_sleep_mode(SLEEP_MODE_IDLE); // cpu stops, timers, twi, and usart keep running
+   }
+
+// Run whichever tasks are due.
+//
+PUBLIC void
+TASK_run(TASK *tasks, BYTE n)
+   {
+   for (TASK *t = tasks; t < tasks + n; ++t)
+      {
+      TICKS now  = TIME_now();
+      TICKS late = now - t->release;
+      if ((SDWORD)late < 0)
+         continue; // not due yet
+
+      if (late > t->late)
+         t->late = late;
+      if (late > t->deadline)
+         {
+         t->overruns += 1;
+         t->release   = now;
+         }
+      t->release += t->period;
+
+      t->job();
+      }
+   }
+
+// Sleep until the next interrupt, unless a task is already due.
+// The ticker wakes us at least once per tick, which is as often as a release can come due.
+//
+PUBLIC void
+TASK_idle(TASK *tasks, BYTE n)
+   {
+   DI();
+   TICKS now = TIME_now();
+   for (TASK *t = tasks; t < tasks + n; ++t)
+      if ((SDWORD)(now - t->release) >= 0)
+         {
+         EI();
+         return;
+         }
+
+   // an interrupt arriving after the check above would otherwise be serviced before we go to sleep, and we'd miss its wakeup,
+   // but the instruction following sei() always executes before any pending interrupt
+   //
+   sleep_enable();
+   sei();
+   sleep_cpu();
+   sleep_disable();
+   EI();
+   }
+
+// Display statistics: worst lateness (since TASK_start) and number of overruns, per task.
+//
+PUBLIC void
+TASK_show(TASK *tasks, BYTE n)
+   {
+   for (TASK *t = tasks; t < tasks + n; ++t)
+      printf("%s=(%5.1fms %3u) ", t->name, t->late * (1000.0 / TICKER_HZ), t->overruns);
+   }
@@ -1,9 +1,10 @@
 // Time base generator and background task dispatcher.
 //
-// Units:      TIMER0
+// Units:      TIMER0, INT0 (with HAVE_DATA_READY)
 // Counters:   TCNT0
 // Registers:  OCR0A
-// Interrupts: TIMER0_COMPA
+// Interrupts: TIMER0_COMPA, INT0 (with HAVE_DATA_READY)
+// Ports:      PORTD2 (with HAVE_DATA_READY)
 //
 // --------------------------------------------------------------------
 // Implementation.
@@ -13,9 +14,58 @@
 // Interrupt communication area - updated at TICKER_HZ rate.
 //
 volatile TICKS  ISR_Ticks;    // number of interrupts
-volatile COUNTS ISR_Duration; // time spent in interrupt service routine
+volatile COUNTS ISR_Duration; // time spent in interrupt service routine with interrupts disabled (acquisition, ie. top half)
+volatile COUNTS IMU_Duration; // time spent integrating the latest timestep (bottom half, including any interrupts serviced meanwhile)
+volatile WORD   ISR_Overlaps; // number of timesteps whose top half found the previous bottom half still running
+volatile WORD   ISR_Unread;   // number of timesteps whose sensor readout couldn't be submitted (bus still busy with the previous one)
 // --------------------------------------------------------------------
 
+// Run background tasks, at IMU_HZ rate.
+// Called by interrupt, with interrupts disabled.
+//
+// The work is split in two:
+// - top half:    MPU_update starts (or, with polled transfers, performs) the sensor readouts, whose completions queue the raw rates
+//                for the integrator. This is all that runs with interrupts disabled.
+// - bottom half: IMU_update integrates whatever has been queued, with interrupts re-enabled, so the next tick (and the twi and
+//                usart) can be serviced meanwhile. If that tick finds a bottom half still running, it only does its top half, and leaves
+//                the new readout for the running bottom half to pick up. A bottom half that falls a whole queue's length behind folds
+//                further readouts into the queue's newest entry rather than dropping them [see GYRO_put()].
+//                A readout can complete after the bottom half last found the queue empty, but before it disables interrupts to
+//                finish, so it checks once more with interrupts disabled rather than leave that readout for the next timestep.
+//
+PRIVATE void
+TICKER_dispatch()
+   {
+   static volatile BOOL busy; // bottom half running?
+
+   COUNTS start = COUNTER_get();
+   if (!MPU_update())
+      ISR_Unread += 1;
+   ISR_Duration = COUNTER_get() - start;
+
+   if (busy)
+      {
+      ISR_Overlaps += 1;
+      return;
+      }
+   busy = 1;
+   for (;;)
+      {
+      sei();
+      for (;;)
+         {
+         start = COUNTER_get();
+         if (!IMU_update())
+            break;
+         IMU_Duration = COUNTER_get() - start;
+         }
+      cli();
+      if (!GYRO_queued())
+         break;
+      }
+   busy = 0;
+   }
+
 // Interrupt service routine executed at TICKER_HZ rate.
 //
 ISR(TIMER0_COMPA_vect)
@@ -23,28 +73,40 @@ ISR(TIMER0_COMPA_vect)
    // Update timebase.
    ISR_Ticks += 1;
    
+#if !HAVE_DATA_READY
    // Dispatch background tasks at IMU_HZ rate.
    //
-   // Note that these functions must complete in less than 2 timer tick intervals in order to avoid losing interrupts.
-   // Given the way we've configured the interrupt rate and 2/4 divider:
-   // - For 16 MHz clock, 2 timer tick intervals = 2 ms. The measured interrupt service duration is ~1.5 ms.
-   // - For  8 MHz clock, 2 timer tick intervals = 4 ms. The measured interrupt service duration is ~3.0 ms.
+   // Note that the top half must complete in less than 2 timer tick intervals in order to avoid losing interrupts.
+   // Given the way we've configured the interrupt rate and TICKER_HZ / IMU_HZ divider:
+   // - For 16 MHz clock, 2 timer tick intervals = 2 ms.
+   // - For  8 MHz clock, 2 timer tick intervals = 4 ms.
+   // - For 20 MHz clock, 2 timer tick intervals = 1.6 ms.
+   // With polled TWI transfers the top half includes the bus time of the sensor burst, well within those limits.
+   // With TWI_USE_INTERRUPT, MPU_update only starts the burst and the bus time is spent outside this routine (via TWI_vect).
+   // The bottom half, which used to bring the whole routine to ~1.5 ms (16 MHz), runs with interrupts enabled and only has to keep up
+   // with IMU_HZ on average.
    //
    static BYTE n;
-#if   IMU_HZ == TICKER_HZ / 4
-   if (++n & 3) return;
-#elif IMU_HZ == TICKER_HZ / 2
-   if (++n & 1) return;
-#else
+#if TICKER_HZ % IMU_HZ || TICKER_HZ / IMU_HZ > 255
    #error TICKER
 #endif
+   if (++n < TICKER_HZ / IMU_HZ) return;
+   n = 0;
    
-   COUNTS start = COUNTER_get();
-   MPU_update();
-   IMU_update();
-   ISR_Duration = COUNTER_get() - start;
+   TICKER_dispatch();
+#endif
    }
 
+#if HAVE_DATA_READY
+// Interrupt service routine executed on each rising edge of the mpu's "data ready" pulse, at its sample rate (== IMU_HZ).
+// The integrator thus steps exactly once per sensor sample, so no sample is skipped or integrated twice, and TIMER0 only keeps time.
+//
+ISR(INT0_vect)
+   {
+   TICKER_dispatch();
+   }
+#endif
+
 // --------------------------------------------------------------------
 // Interface.
 // --------------------------------------------------------------------
@@ -66,9 +128,7 @@ TICKER_init()
    TCCR0B = 0
           | (0 << WGM02) // "
           
-          | (1 << CS00)  // prescaler = 64
-          | (1 << CS01)  // "
-          | (0 << CS02)  // "
+          | CLOCK_TICKER_CS // prescaler, from clock plan ("clock.h")
           ;
 
    // Set terminal count value (TOP) at which to generate a
@@ -88,17 +148,12 @@ TICKER_init()
    // For CLOCK =  8 MHz, PRESCALER = 64, RATE =  500Hz:
    //    TOP =  8,000,000 / 64 / 500  - 1 = 249
    //
-   // Note that TIMER0 is an 8 bit timer, so TOP must be <= 255.
+   // For CLOCK = 20 MHz, PRESCALER = 64, RATE = 1250Hz:
+   //    TOP = 20,000,000 / 64 / 1250 - 1 = 249
    //
-
-   // Generate 1000 interrupts per second for 16 MHz clock,
-   // or        500 interrupts per second for  8 MHz clock.
+   // Note that TIMER0 is an 8 bit timer, so TOP must be <= 255.
    //
-   #if (CLOCK_MHZ == 16 && TICKER_HZ == 1000) || (CLOCK_MHZ == 8 && TICKER_HZ == 500)
-   OCR0A = 249;  // TOP
-   #else
-   #error TICKER
-   #endif
+   OCR0A = CLOCK_TICKER_TOP;
    
    // Start counter at 0.
    //
@@ -108,9 +163,30 @@ TICKER_init()
    //
    TIMSK0 |= (1 << OCIE0A);
 
+#if HAVE_DATA_READY
+   // Enable "INT0 rising edge" interrupts from mpu's INT pin.
+   //
+   DDRD  &= ~(1 << DDD2);                 // configure PORTD2 as input
+   EICRA  =  (1 << ISC01) | (1 << ISC00); // rising edge
+   EIFR   =  (1 << INTF0);                // discard any edge seen before now
+   EIMSK |=  (1 << INT0);
+#endif
+
    printf("clock=(%.3fus,%uMHz) ticker=(%.2fms,%uHz) timestep=(%.2fms,%uHz)\n",
           1e6 / (CLOCK_MHZ * 1e6), CLOCK_MHZ,
-          1e3 / TICKER_HZ,         TICKER_HZ,
+          1e3 / TICKER_HZ,         (WORD)TICKER_HZ,
           1e3 / IMU_HZ,            IMU_HZ
           );
    }
+
+// Get number of timesteps whose top half found the previous bottom half still running,
+// and number whose sensor readout couldn't be submitted (since startup).
+//
+PUBLIC void
+TICKER_getSkips(WORD *overlaps, WORD *unread)
+   {
+   DI();
+   *overlaps = ISR_Overlaps;
+   *unread   = ISR_Unread;
+   EI();
+   }
@@ -17,6 +17,26 @@ TIME_now()
    return t;
    }
 
+// Timestamps, in TIMER0 counts: TIME_STAMP_HZ per second (eg. 4us resolution at 16 MHz), wrapping after 2^32 counts (4.7 hours at 16 MHz).
+//
+#define TIME_STAMP_HZ (CLOCK_HZ / CLOCK_TICKER_PRESCALER)
+
+// Get current time, to a fraction of a tick.
+// May be called by interrupt.
+//
+PUBLIC DWORD
+TIME_stamp()
+   {
+   extern volatile TICKS ISR_Ticks;
+   DI();
+   TICKS t = ISR_Ticks;
+   BYTE  c = TCNT0;
+   if ((TIFR0 & (1 << OCF0A)) && c < CLOCK_TICKER_TOP / 2) // counter has wrapped, but its interrupt is still pending
+      t += 1;
+   EI();
+   return t * (CLOCK_TICKER_TOP + 1) + c;
+   }
+
 // How much time has elapsed since "start", in seconds?
 //
 PUBLIC FLOAT